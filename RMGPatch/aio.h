@@ -0,0 +1,476 @@
+#pragma once
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include "util.h"
+#include "threads.h"
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+//BATCHED FILE IO
+//with lots of small files the opens, reads and closes cost more than the data. on linux an io_uring
+//keeps AIO_DEPTH files of them in flight from one thread, and what it reads goes to the workers through a
+//queue as each file completes. written files go the other way, workers hand them over and carry on.
+//without io_uring (other systems, old kernels, containers that block it) workers do their own io as before
+#define AIO_DEPTH 64 //files in flight at once
+#define AIO_SMALL 0x100000 //1MB, bigger files get mapped by whoever uses them instead
+#define AIO_WRITEBUF ((int64)64 << 20) //put() waits while this much is handed over but not written yet
+static bool uring = true; //off with --uring=n
+
+#ifdef __linux__
+//just the raw syscalls, liburing isn't a dependency
+struct Ring {
+    Ring() {}
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+    ~Ring() {
+        if (sqes) munmap(sqes, entries * sizeof(io_uring_sqe));
+        if (cqmap && cqmap != sqmap) munmap(cqmap, cqsize);
+        if (sqmap) munmap(sqmap, sqsize);
+        if (fd >= 0) close(fd);
+    }
+    bool setup(unsigned n) {
+        io_uring_params p = {};
+        fd = (int)syscall(__NR_io_uring_setup, n, &p);
+        if (fd < 0) return false;
+        entries = p.sq_entries;
+        sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqsize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sqsize = cqsize = std::max(sqsize, cqsize);
+        sqmap = mmap(nullptr, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqmap == MAP_FAILED) return sqmap = nullptr, false;
+        cqmap = single ? sqmap : mmap(nullptr, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqmap == MAP_FAILED) return cqmap = nullptr, false;
+        void* s = mmap(nullptr, entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (s == MAP_FAILED) return false;
+        sqes = (io_uring_sqe*)s;
+        char* sq = (char*)sqmap;
+        char* cq = (char*)cqmap;
+        sqhead = (unsigned*)(sq + p.sq_off.head);
+        sqtail = (unsigned*)(sq + p.sq_off.tail);
+        sqmask = *(unsigned*)(sq + p.sq_off.ring_mask);
+        sqarray = (unsigned*)(sq + p.sq_off.array);
+        cqhead = (unsigned*)(cq + p.cq_off.head);
+        cqtail = (unsigned*)(cq + p.cq_off.tail);
+        cqmask = *(unsigned*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        tail = *sqtail;
+        return supports({ IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE });
+    }
+    //a kernel can have io_uring without some of the ops
+    bool supports(std::initializer_list<int> ops) {
+        std::vector<char> buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+        io_uring_probe* probe = (io_uring_probe*)buf.data();
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+        for (int op : ops)
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+        return true;
+    }
+    //the next free submission, cleared. null if the ring's full
+    io_uring_sqe* get() {
+        if (tail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE) >= entries) return nullptr;
+        io_uring_sqe* e = &sqes[tail & sqmask];
+        memset(e, 0, sizeof(*e));
+        sqarray[tail & sqmask] = tail & sqmask;
+        tail++;
+        return e;
+    }
+    //submits what's been queued and waits for at least wait completions
+    bool submit(unsigned wait) {
+        __atomic_store_n(sqtail, tail, __ATOMIC_RELEASE);
+        for (;;) {
+            unsigned n = tail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+            long r = syscall(__NR_io_uring_enter, fd, n, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (r >= 0) return true;
+            if (errno != EINTR && errno != EAGAIN) return false;
+        }
+    }
+    bool next(io_uring_cqe& c) {
+        unsigned head = *cqhead;
+        if (head == __atomic_load_n(cqtail, __ATOMIC_ACQUIRE)) return false;
+        c = cqes[head & cqmask];
+        __atomic_store_n(cqhead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    int fd = -1;
+    unsigned entries = 0, tail = 0, sqmask = 0, cqmask = 0;
+    unsigned *sqhead = nullptr, *sqtail = nullptr, *sqarray = nullptr, *cqhead = nullptr, *cqtail = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    void *sqmap = nullptr, *cqmap = nullptr;
+    size_t sqsize = 0, cqsize = 0;
+};
+
+//whether a ring can be had at all, only asked once
+inline bool uringok() {
+    static bool ok = [] {
+        Ring r;
+        return r.setup(4);
+    }();
+    return uring && ok;
+}
+
+//one file's trip through a ring: open, statx if the size isn't known, reads or writes until it's all
+//done, close. op says which of those is in flight
+enum { AIO_OPEN, AIO_STAT, AIO_IO, AIO_CLOSE };
+struct AioSlot {
+    int64 item = -1;
+    std::string path;
+    int fd = -1;
+    int op = AIO_OPEN;
+    int64 done = 0;
+    int64 size = -1;
+    charvec data;
+    struct statx sx;
+};
+inline void aioopen(Ring& r, AioSlot& s, uint64_t tag, int flags) {
+    io_uring_sqe* e = r.get();
+    e->opcode = IORING_OP_OPENAT;
+    e->fd = AT_FDCWD;
+    e->addr = (uint64_t)s.path.c_str();
+    e->open_flags = flags | O_CLOEXEC;
+    e->len = 0666;
+    e->user_data = tag;
+    s.op = AIO_OPEN;
+}
+inline void aiostat(Ring& r, AioSlot& s, uint64_t tag) {
+    io_uring_sqe* e = r.get();
+    e->opcode = IORING_OP_STATX;
+    e->fd = s.fd;
+    e->addr = (uint64_t)"";
+    e->statx_flags = AT_EMPTY_PATH;
+    e->len = STATX_SIZE;
+    e->off = (uint64_t)&s.sx;
+    e->user_data = tag;
+    s.op = AIO_STAT;
+}
+inline void aioio(Ring& r, AioSlot& s, uint64_t tag, bool write) {
+    io_uring_sqe* e = r.get();
+    e->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    e->fd = s.fd;
+    e->addr = (uint64_t)(s.data.data() + s.done);
+    e->len = (unsigned)MIN(s.size - s.done, 0x40000000);
+    e->off = s.done;
+    e->user_data = tag;
+    s.op = AIO_IO;
+}
+inline void aioclose(Ring& r, AioSlot& s, uint64_t tag) {
+    io_uring_sqe* e = r.get();
+    e->opcode = IORING_OP_CLOSE;
+    e->fd = s.fd;
+    e->user_data = tag;
+    s.op = AIO_CLOSE;
+    s.fd = -1;
+}
+//a ring that stopped taking submissions may still be working on the slots that aren't idle. each gets a
+//cancel and its last completion is waited for, after that they're the caller's again with their files
+//closed. false if the ring won't even do that, the kernel may write to them for good then
+#define AIO_CANCEL (1ULL << 63) //tags the cancels apart from the slot numbers
+inline bool aiodrain(Ring& r, AioSlot* slots, int count, const std::vector<int>& idle) {
+    int left = 0;
+    for (int s = 0; s < count; s++) {
+        if (std::find(idle.begin(), idle.end(), s) != idle.end()) continue;
+        io_uring_sqe* e = r.get();
+        if (!e) return false;
+        e->opcode = IORING_OP_ASYNC_CANCEL;
+        e->addr = s;
+        e->user_data = s | AIO_CANCEL;
+        left++;
+    }
+    while (left) {
+        if (!r.submit(1)) return false;
+        io_uring_cqe c;
+        while (r.next(c)) {
+            if (c.user_data & AIO_CANCEL) continue;
+            AioSlot& s = slots[c.user_data];
+            if (s.op == AIO_OPEN && c.res >= 0) close(c.res); //got opened before the cancel
+            if (s.fd >= 0) close(s.fd);
+            s.fd = -1;
+            left--;
+        }
+    }
+    return true;
+}
+#else
+inline bool uringok() { return false; }
+#endif
+
+//reads files [0, count) whole and runs fn(i, data) for each on a pool of workers, in whatever order they
+//come in. pathof(i) is the file, empty to not read it; sizeof_(i) its size if known, -1 if not. data is
+//null when item i wasn't read or couldn't be, and always without a ring, fn reads it itself then
+template <typename P, typename S, typename F>
+void loadfiles(int64 count, P pathof, S sizeof_, F fn) {
+    using namespace std;
+    if (!uringok()) {
+        parallelfor(count, [&](int64 i) { fn(i, nullptr); });
+        return;
+    }
+#ifdef __linux__
+    Ring ring;
+    if (!ring.setup(AIO_DEPTH * 2)) {
+        parallelfor(count, [&](int64 i) { fn(i, nullptr); });
+        return;
+    }
+    //finished files wait here for a worker. capped so reading can't run off ahead of the work
+    mutex m;
+    condition_variable cv;
+    deque<pair<int64, charvec>> ready;
+    deque<int64> failed;
+    bool over = false;
+    size_t cap = threadcount() * 2;
+    auto deliver = [&](int64 i, charvec* data) {
+        {
+            unique_lock<mutex> l(m);
+            cv.wait(l, [&] { return ready.size() + failed.size() < cap; });
+            if (data) ready.push_back({ i, move(*data) });
+            else failed.push_back(i);
+        }
+        cv.notify_all();
+    };
+    auto work = [&] {
+        for (;;) {
+            unique_lock<mutex> l(m);
+            cv.wait(l, [&] { return ready.size() || failed.size() || over; });
+            if (failed.size()) {
+                int64 i = failed.front();
+                failed.pop_front();
+                l.unlock();
+                cv.notify_all();
+                fn(i, nullptr);
+                continue;
+            }
+            if (ready.empty()) break;
+            pair<int64, charvec> f = move(ready.front());
+            ready.pop_front();
+            l.unlock();
+            cv.notify_all();
+            fn(f.first, &f.second);
+        }
+    };
+    vector<thread> pool;
+    for (int i = 0; i < threadcount(); i++) pool.emplace_back(work);
+    unique_ptr<AioSlot[]> slots(new AioSlot[AIO_DEPTH]); //not in a vector, they may have to be leaked where they are
+    vector<int> idle;
+    for (int s = AIO_DEPTH - 1; s >= 0; s--) idle.push_back(s);
+    int64 next = 0, inflight = 0;
+    bool broken = false;
+    while (!broken && (next < count || inflight)) {
+        while (next < count && idle.size()) {
+            string path = pathof(next);
+            if (path.empty()) {
+                deliver(next++, nullptr);
+                continue;
+            }
+            AioSlot& s = slots[idle.back()];
+            idle.pop_back();
+            s = AioSlot();
+            s.item = next;
+            s.path = move(path);
+            s.size = sizeof_(next++);
+            aioopen(ring, s, &s - slots.get(), O_RDONLY);
+            inflight++;
+        }
+        if (!inflight) break;
+        if (!ring.submit(1)) broken = true;
+        io_uring_cqe c;
+        while (ring.next(c)) {
+            AioSlot& s = slots[c.user_data];
+            int64 tag = c.user_data;
+            bool fail = c.res < 0 && s.op != AIO_CLOSE;
+            if (fail && s.fd >= 0) close(s.fd);
+            if (fail) s.fd = -1;
+            if (fail || s.op == AIO_CLOSE) {
+                inflight--;
+                if (fail) deliver(s.item, nullptr);
+                else deliver(s.item, &s.data);
+                s.data = charvec();
+                idle.push_back(tag);
+                continue;
+            }
+            if (s.op == AIO_OPEN) s.fd = c.res;
+            else if (s.op == AIO_STAT) s.size = s.sx.stx_size;
+            else if (s.op == AIO_IO) {
+                s.done += c.res;
+                if (!c.res) s.size = s.done; //got shorter since it was scanned
+            }
+            if (s.op == AIO_OPEN && s.size < 0) aiostat(ring, s, tag);
+            else if (s.done < s.size) {
+                if (s.data.size() != (size_t)s.size) s.data.resize(s.size);
+                aioio(ring, s, tag, false);
+            }
+            else {
+                s.data.resize(s.done);
+                aioclose(ring, s, tag);
+            }
+        }
+    }
+    //a ring that stopped working leaves the rest to the workers, what was in flight included
+    if (broken) {
+        AioSlot* all = slots.get();
+        if (!aiodrain(ring, all, AIO_DEPTH, idle)) slots.release(); //still the kernel's, never freed
+        for (int s = 0; s < AIO_DEPTH; s++)
+            if (find(idle.begin(), idle.end(), s) == idle.end()) deliver(all[s].item, nullptr);
+    }
+    for (; broken && next < count; next++) deliver(next, nullptr);
+    {
+        lock_guard<mutex> l(m);
+        over = true;
+    }
+    cv.notify_all();
+    for (auto& t : pool) t.join();
+#endif
+}
+
+//write behind for finished files. put() hands one over to the ring's thread and returns right away,
+//wait() returns once everything put so far is written, with the tags of what couldn't be. without a
+//ring put() writes it then and there
+struct FileWriter {
+    FileWriter() {
+#ifdef __linux__
+        if (uringok() && ring.setup(AIO_DEPTH * 2)) {
+            direct = false;
+            thr = std::thread([this] { run(); });
+        }
+#endif
+    }
+    ~FileWriter() {
+        {
+            std::lock_guard<std::mutex> l(m);
+            stop = true;
+        }
+        cv.notify_all();
+        if (thr.joinable()) thr.join();
+    }
+    void put(const std::string& path, charvec data, int64 tag) {
+        {
+            std::unique_lock<std::mutex> l(m);
+            cv.wait(l, [&] { return direct || queued < AIO_WRITEBUF || jobs.empty(); });
+            if (!direct) {
+                queued += data.size();
+                jobs.push_back({ path, std::move(data), tag });
+                pending++;
+            }
+        }
+        if (direct && !writeout(path, data)) fail(tag);
+        cv.notify_all();
+    }
+    std::vector<int64> wait() {
+        std::unique_lock<std::mutex> l(m);
+        cv.wait(l, [&] { return !pending; });
+        std::vector<int64> r;
+        r.swap(failed);
+        return r;
+    }
+    void fail(int64 tag) {
+        std::lock_guard<std::mutex> l(m);
+        failed.push_back(tag);
+    }
+    static bool writeout(const std::string& path, const charvec& data) {
+        std::ofstream out(path, std::ios::binary | std::ios::out);
+        out.write((char*)data.data(), data.size());
+        out.close();
+        return (bool)out;
+    }
+
+    struct Job {
+        std::string path;
+        charvec data;
+        int64 tag;
+    };
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<Job> jobs;
+    std::vector<int64> failed;
+    int64 queued = 0, pending = 0;
+    bool stop = false, direct = true;
+    std::thread thr;
+#ifdef __linux__
+    Ring ring;
+    void run() {
+        std::unique_ptr<AioSlot[]> slots(new AioSlot[AIO_DEPTH]); //see loadfiles
+        std::vector<int64> tags(AIO_DEPTH);
+        std::vector<int> idle;
+        for (int s = AIO_DEPTH - 1; s >= 0; s--) idle.push_back(s);
+        int64 inflight = 0;
+        auto finish = [&](AioSlot& s, bool ok) {
+            std::lock_guard<std::mutex> l(m);
+            if (!ok) failed.push_back(tags[&s - slots.get()]);
+            queued -= s.size;
+            pending--;
+            s.data = charvec();
+            idle.push_back(&s - slots.get());
+        };
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> l(m);
+                if (!inflight) cv.wait(l, [&] { return jobs.size() || stop; });
+                if (!inflight && jobs.empty()) break;
+                while (jobs.size() && idle.size()) {
+                    int si = idle.back();
+                    idle.pop_back();
+                    AioSlot& s = slots[si];
+                    s = AioSlot();
+                    s.path = std::move(jobs.front().path);
+                    s.data = std::move(jobs.front().data);
+                    s.size = s.data.size();
+                    tags[si] = jobs.front().tag;
+                    jobs.pop_front();
+                    aioopen(ring, s, si, O_WRONLY | O_CREAT | O_TRUNC);
+                    inflight++;
+                }
+            }
+            cv.notify_all();
+            if (!ring.submit(1)) {
+                //what's in flight is cancelled and written here instead, so is everything after, and put() does
+                //its own from now on
+                std::unique_lock<std::mutex> l(m);
+                bool drained = aiodrain(ring, slots.get(), AIO_DEPTH, idle);
+                for (int si = 0; si < AIO_DEPTH; si++) {
+                    if (std::find(idle.begin(), idle.end(), si) != idle.end()) continue;
+                    if (!drained || !writeout(slots[si].path, slots[si].data)) failed.push_back(tags[si]);
+                    pending--;
+                }
+                if (!drained) slots.release(); //still the kernel's, never freed
+                for (; jobs.size(); jobs.pop_front()) {
+                    if (!writeout(jobs.front().path, jobs.front().data)) failed.push_back(jobs.front().tag);
+                    pending--;
+                }
+                direct = true;
+                l.unlock();
+                cv.notify_all();
+                return;
+            }
+            io_uring_cqe c;
+            while (ring.next(c)) {
+                AioSlot& s = slots[c.user_data];
+                bool fail = c.res < 0 || (s.op == AIO_IO && !c.res);
+                if (fail && s.op != AIO_CLOSE && s.fd >= 0) close(s.fd);
+                if (fail || s.op == AIO_CLOSE) {
+                    inflight--;
+                    finish(s, !fail);
+                    continue;
+                }
+                if (s.op == AIO_OPEN) s.fd = c.res;
+                else s.done += c.res;
+                if (s.done < s.size) aioio(ring, s, c.user_data, true);
+                else aioclose(ring, s, c.user_data);
+            }
+            cv.notify_all();
+        }
+    }
+#endif
+};
@@ -0,0 +1,175 @@
+#pragma once
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include "util.h"
+#include "threads.h"
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#endif
+
+//PARALLEL DIRECTORY SCAN
+//one task per directory on a shared queue. a task lists its directory without touching the tree, then
+//adds everything under the node it was handed in one go and queues the subdirs, so nothing ever gets
+//looked up by path
+struct ScanTask {
+    Dir* dir;
+    std::string path; //full path with a trailing '/'
+    int root;
+};
+struct ScanEntry {
+    std::string name;
+    bool isdir;
+    bool enter; //a real subdir that gets its own task
+    int64 filesize;
+    int64 mtime;
+    uint64_t inode;
+};
+
+//makes the root use forward slashes and end with a '/'
+inline void fixroot(std::string& rootstr) {
+#ifdef _WIN32
+    std::replace(rootstr.begin(), rootstr.end(), '\\', '/');
+#endif
+    if (rootstr.empty() || rootstr.back() != '/') rootstr.append("/");
+}
+
+#ifdef __linux__
+//now, in the same units and epoch as the mtimes the scanner records
+inline int64 scanstamp() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct linuxdirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+//getdents64 for the names and types, statx relative to the dir fd only for what isn't a plain dir
+bool scandir1(const ScanTask& t, std::vector<ScanEntry>& entries) {
+    using namespace std;
+    int fd = open(t.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        cout << ("unable to open directory " + t.path + "\n");
+        return false;
+    }
+    alignas(8) static thread_local char buf[0x8000];
+    bool ok = true;
+    for (long n; ok && (n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) != 0;) {
+        if (n < 0) {
+            cout << ("unable to read directory " + t.path + "\n");
+            ok = false;
+            break;
+        }
+        for (long off = 0; off < n;) {
+            linuxdirent64* e = (linuxdirent64*)(buf + off);
+            off += e->d_reclen;
+            const char* name = e->d_name;
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+            ScanEntry c = { name, true, e->d_type == DT_DIR, -1, 0, 0 };
+            if (!c.enter) {
+                //follows links like stat() did, a link to a dir shows up as an empty dir
+                struct statx sx;
+                if (statx(fd, name, AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO, &sx)) {
+                    cout << ("unable to open stat for file " + t.path + name + "\n");
+                    ok = false;
+                    break;
+                }
+                if (!S_ISDIR(sx.stx_mode)) {
+                    c.isdir = false;
+                    c.filesize = sx.stx_size;
+                    c.mtime = (int64)sx.stx_mtime.tv_sec * 1000000000 + sx.stx_mtime.tv_nsec;
+                    c.inode = sx.stx_ino;
+                }
+                else c.enter = e->d_type == DT_UNKNOWN;
+            }
+            entries.push_back(move(c));
+        }
+    }
+    close(fd);
+    return ok;
+}
+#else
+inline int64 scanstamp() {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(std::filesystem::file_time_type::clock::now().time_since_epoch()).count();
+}
+
+//no getdents on windows, directory_entry already carries what FindNextFile returned so this is still
+//one call per entry
+bool scandir1(const ScanTask& t, std::vector<ScanEntry>& entries) {
+    using namespace std;
+    using namespace std::filesystem;
+    error_code ec;
+    for (directory_iterator i(t.path, ec), end; !ec && i != end; i.increment(ec)) {
+        ScanEntry c = { i->path().filename().string(), true, false, -1, 0, 0 };
+        if (i->is_directory(ec)) c.enter = !i->is_symlink(ec);
+        else {
+            c.isdir = false;
+            c.filesize = i->file_size(ec);
+            if (!ec) c.mtime = chrono::duration_cast<chrono::nanoseconds>(i->last_write_time(ec).time_since_epoch()).count(); //no inodes here
+        }
+        if (ec) {
+            cout << ("unable to open stat for file " + t.path + c.name + "\n");
+            return false;
+        }
+        entries.push_back(move(c));
+    }
+    if (ec) cout << ("unable to read directory " + t.path + "\n");
+    return !ec;
+}
+#endif
+
+//scans count roots at once on the same pool. a root that couldn't be read fully comes back empty
+void filesystodirs(std::string* rootstr, std::unique_ptr<DirTree>* out, int count) {
+    using namespace std;
+    vector<ScanTask> seed;
+    unique_ptr<atomic<bool>[]> bad(new atomic<bool>[count]);
+    unique_ptr<mutex[]> locks(new mutex[count]);
+    for (int i = 0; i < count; i++) {
+        fixroot(rootstr[i]);
+        out[i] = unique_ptr<DirTree>(new DirTree());
+        bad[i] = false;
+        seed.push_back({ out[i]->root(), rootstr[i], i });
+    }
+    parallelqueue(seed, [&](ScanTask& t, auto& push) {
+        if (bad[t.root]) return;
+        vector<ScanEntry> entries;
+        if (!scandir1(t, entries)) {
+            bad[t.root] = true;
+            return;
+        }
+        //sorted so the tree doesn't depend on the filesystem's order
+        sort(entries.begin(), entries.end(), [](const ScanEntry& a, const ScanEntry& b) { return a.name < b.name; });
+        vector<ScanTask> subdirs;
+        {
+            lock_guard<mutex> l(locks[t.root]);
+            for (const ScanEntry& e : entries) {
+                Dir* c = out[t.root]->add(t.dir, e.name, e.isdir);
+                c->filesize = e.filesize;
+                c->mtime = e.mtime;
+                c->inode = e.inode;
+                if (e.enter) subdirs.push_back({ c, t.path + e.name + "/", t.root });
+            }
+        }
+        for (ScanTask& s : subdirs) push(move(s));
+    });
+    for (int i = 0; i < count; i++) {
+        if (bad[i]) out[i].reset();
+        else out[i]->root()->filesize = 0; //use as return code of sorts
+    }
+}
+
+std::unique_ptr<DirTree> filesystodir(std::string& rootstr) {
+    std::unique_ptr<DirTree> r;
+    filesystodirs(&rootstr, &r, 1);
+    return r;
+}
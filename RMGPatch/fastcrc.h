@@ -0,0 +1,243 @@
+#pragma once
+#include <cstring>
+#include <fstream>
+#include "util.h"
+#include "threads.h"
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define FASTCRC_X86
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CLMUL_TARGET
+#else
+#include <cpuid.h>
+#define CLMUL_TARGET __attribute__((target("pclmul,sse4.1")))
+#endif
+#endif
+
+//CRC-32 (same params as CRC::CRC_32(), reflected 0x04C11DB7, init/xorout 0xFFFFFFFF)
+//all functions take and return the finished crc so they can be chained like zlib's crc32()
+#define CRCPOLY 0xEDB88320
+
+struct CRCTables {
+    uint t[16][256];
+    uint x2n[32]; //x^(2^n) mod p, for combining
+    CRCTables() {
+        for (uint i = 0; i < 256; i++) {
+            uint c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ CRCPOLY : c >> 1;
+            t[0][i] = c;
+        }
+        for (uint i = 0; i < 256; i++)
+            for (int k = 1; k < 16; k++) t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+        uint p = (uint)1 << 30; //x^1
+        x2n[0] = p;
+        for (int n = 1; n < 32; n++) x2n[n] = p = multmodp(p, p);
+    }
+    static uint multmodp(uint a, uint b) {
+        uint m = (uint)1 << 31, p = 0;
+        for (;;) {
+            if (a & m) {
+                p ^= b;
+                if (!(a & (m - 1))) break;
+            }
+            m >>= 1;
+            b = b & 1 ? (b >> 1) ^ CRCPOLY : b >> 1;
+        }
+        return p;
+    }
+};
+inline const CRCTables& crctables() {
+    static const CRCTables tables;
+    return tables;
+}
+
+//slicing-by-16 with a slicing-by-8 step for the remainder. works on the raw (inverted) register
+uint crc32slice(uint c, const byte* p, int64 n) {
+    const auto& t = crctables().t;
+    while (n >= 16) {
+        uint64_t a, b;
+        memcpy(&a, p, 8);
+        memcpy(&b, p + 8, 8);
+        a ^= c;
+        c = t[15][a & 0xFF] ^ t[14][(a >> 8) & 0xFF] ^ t[13][(a >> 16) & 0xFF] ^ t[12][(a >> 24) & 0xFF] ^
+            t[11][(a >> 32) & 0xFF] ^ t[10][(a >> 40) & 0xFF] ^ t[9][(a >> 48) & 0xFF] ^ t[8][a >> 56] ^
+            t[7][b & 0xFF] ^ t[6][(b >> 8) & 0xFF] ^ t[5][(b >> 16) & 0xFF] ^ t[4][(b >> 24) & 0xFF] ^
+            t[3][(b >> 32) & 0xFF] ^ t[2][(b >> 40) & 0xFF] ^ t[1][(b >> 48) & 0xFF] ^ t[0][b >> 56];
+        p += 16;
+        n -= 16;
+    }
+    if (n >= 8) {
+        uint64_t a;
+        memcpy(&a, p, 8);
+        a ^= c;
+        c = t[7][a & 0xFF] ^ t[6][(a >> 8) & 0xFF] ^ t[5][(a >> 16) & 0xFF] ^ t[4][(a >> 24) & 0xFF] ^
+            t[3][(a >> 32) & 0xFF] ^ t[2][(a >> 40) & 0xFF] ^ t[1][(a >> 48) & 0xFF] ^ t[0][a >> 56];
+        p += 8;
+        n -= 8;
+    }
+    while (n--) c = (c >> 8) ^ t[0][(c ^ *p++) & 0xFF];
+    return c;
+}
+
+#ifdef FASTCRC_X86
+//carry-less multiply folding (intel's "fast crc computation using pclmulqdq" paper), 4x128 bits at a time
+//needs n >= 64, does everything that's a multiple of 16 and leaves the rest to crc32slice
+CLMUL_TARGET uint crc32clmul(uint c, const byte* p, int64 n) {
+    alignas(16) static const uint64_t k1k2[2] = { 0x0154442bd4, 0x01c6e41596 };
+    alignas(16) static const uint64_t k3k4[2] = { 0x01751997d0, 0x00ccaa009e };
+    alignas(16) static const uint64_t k5k0[2] = { 0x0163cd6124, 0x0000000000 };
+    alignas(16) static const uint64_t poly[2] = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    p += 64;
+    n -= 64;
+    while (n >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(p + 0x30)));
+        p += 64;
+        n -= 64;
+    }
+    //fold the 4 lanes down to 1
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+    while (n >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)p);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16;
+        n -= 16;
+    }
+    //128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    //barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i*)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    c = (uint)_mm_extract_epi32(x1, 1);
+    return crc32slice(c, p, n);
+}
+
+inline bool hasclmul() {
+    static const bool has = [] {
+        uint regs[4] = { 0, 0, 0, 0 };
+#ifdef _MSC_VER
+        __cpuid((int*)regs, 1);
+#else
+        if (!__get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3])) return false;
+#endif
+        return (regs[2] & (1 << 1)) && (regs[2] & (1 << 19)); //pclmulqdq + sse4.1
+    }();
+    return has;
+}
+#endif
+
+//picked once at startup
+inline uint (*crc32kernel())(uint, const byte*, int64) {
+#ifdef FASTCRC_X86
+    static uint (*const k)(uint, const byte*, int64) = hasclmul() ? crc32clmul : crc32slice;
+    return k;
+#else
+    return crc32slice;
+#endif
+}
+
+uint crc32buf(const void* data, int64 size, uint crc = 0) {
+    const byte* p = (const byte*)data;
+    uint c = ~crc;
+    if (size >= 64) c = crc32kernel()(c, p, size);
+    else c = crc32slice(c, p, size);
+    return ~c;
+}
+
+//crc of a+b from crc(a), crc(b) and len(b), same maths as zlib's crc32_combine
+uint crc32combine(uint crca, uint crcb, int64 lenb) {
+    const auto& tbl = crctables();
+    uint p = (uint)1 << 31; //x^0
+    unsigned k = 3; //lenb is in bytes, so start at x^(2^3)
+    while (lenb > 0) {
+        if (lenb & 1) p = CRCTables::multmodp(tbl.x2n[k & 31], p);
+        lenb >>= 1;
+        k++;
+    }
+    return CRCTables::multmodp(p, crca) ^ crcb;
+}
+
+//PARALLEL
+#define CRCCHUNK 0x1000000 //16MB per task
+
+//crcs CRCCHUNK sized pieces on the worker threads and combines them in order
+uint crc32par(const void* data, int64 size, uint crc = 0) {
+    int64 chunks = (size + CRCCHUNK - 1) / CRCCHUNK;
+    if (chunks <= 1 || threadcount() <= 1) return crc32buf(data, size, crc);
+    std::vector<uint> parts(chunks);
+    parallelfor(chunks, [&](int64 i) {
+        int64 off = i * CRCCHUNK;
+        parts[i] = crc32buf((const byte*)data + off, MIN(CRCCHUNK, size - off));
+    });
+    for (int64 i = 0; i < chunks; i++)
+        crc = crc32combine(crc, parts[i], MIN(CRCCHUNK, size - i * CRCCHUNK));
+    return crc;
+}
+
+//same as above but straight from disk, every task reads its own chunk through its own handle
+//so the whole file never has to be in memory. false if the file can't be opened or is shorter than size
+bool crc32file(const std::string& path, int64 size, uint& crc) {
+    crc = 0;
+    int64 chunks = (size + CRCCHUNK - 1) / CRCCHUNK;
+    if (!chunks) return (bool)std::ifstream(path, std::ios::binary | std::ios::in);
+    std::vector<uint> parts(chunks);
+    std::atomic<bool> ok(true);
+    parallelfor(chunks, [&](int64 i) {
+        static thread_local charvec buf(0x100000);
+        std::ifstream f(path, std::ios::binary | std::ios::in);
+        int64 left = MIN(CRCCHUNK, size - i * CRCCHUNK);
+        uint c = 0;
+        f.seekg(i * CRCCHUNK);
+        while (left > 0 && f.read((char*)buf.data(), MIN(buf.size(), left)).gcount()) {
+            c = crc32buf(buf.data(), f.gcount(), c);
+            left -= f.gcount();
+        }
+        if (left > 0) ok = false;
+        parts[i] = c;
+    });
+    for (int64 i = 0; i < chunks; i++) crc = crc32combine(crc, parts[i], MIN(CRCCHUNK, size - i * CRCCHUNK));
+    return ok;
+}
@@ -0,0 +1,435 @@
+#pragma once
+#include "fastcrc.h"
+#if defined(FASTCRC_X86)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define AVX2_TARGET
+#else
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+//FAST HASH
+//64/128 bit non-cryptographic hash built the same way as xxh3's long input path: 8 64-bit accumulators fed
+//64 byte stripes (32x32->64 multiply of data^secret, data added to the neighbouring lane), scrambled every
+//1KB block and folded down at the end. uses its own secret so the values don't match upstream xxh3.
+//every stripe goes through the same path no matter the length so streaming and one-shot always agree
+#define FH_STRIPE 64
+#define FH_SECRET 192
+#define FH_STRIPES ((FH_SECRET - FH_STRIPE) / 8) //stripes per block
+#define FH_BLOCK (FH_STRIPE * FH_STRIPES)
+#define FH_P32_1 0x9E3779B1U
+#define FH_P32_2 0x85EBCA77U
+#define FH_P32_3 0xC2B2AE3DU
+#define FH_P64_1 0x9E3779B185EBCA87ULL
+#define FH_P64_2 0xC2B2AE3D27D4EB4FULL
+#define FH_P64_3 0x165667B19E3779F9ULL
+#define FH_P64_4 0x85EBCA77C2B2AE63ULL
+#define FH_P64_5 0x27D4EB2F165667C5ULL
+
+inline uint64_t read64(const byte* p) {
+    uint64_t r;
+    memcpy(&r, p, 8);
+    return r;
+}
+
+//splitmix64 of a fixed seed so nobody has to paste 192 magic bytes
+inline const byte* fhsecret() {
+    alignas(64) static byte secret[FH_SECRET];
+    static const bool filled = [] {
+        uint64_t x = FH_P64_3;
+        for (int i = 0; i < FH_SECRET; i += 8) {
+            uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            z ^= z >> 31;
+            memcpy(secret + i, &z, 8);
+        }
+        return true;
+    }();
+    (void)filled;
+    return secret;
+}
+
+//n stripes starting at stripe s of the current block
+void fhstripes(uint64_t* acc, const byte* p, int n, int s) {
+    const byte* sec = fhsecret() + 8 * s;
+    for (int k = 0; k < n; k++, p += FH_STRIPE, sec += 8) {
+        for (int i = 0; i < 8; i++) {
+            uint64_t data = read64(p + 8 * i);
+            uint64_t key = data ^ read64(sec + 8 * i);
+            acc[i ^ 1] += data;
+            acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+        }
+    }
+}
+void fhscramble(uint64_t* acc) {
+    const byte* sec = fhsecret() + FH_SECRET - FH_STRIPE;
+    for (int i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= read64(sec + 8 * i);
+        acc[i] = a * FH_P32_1;
+    }
+}
+//n whole blocks
+void fhblocks(uint64_t* acc, const byte* p, int64 n) {
+    for (; n--; p += FH_BLOCK) {
+        fhstripes(acc, p, FH_STRIPES, 0);
+        fhscramble(acc);
+    }
+}
+
+#ifdef FASTCRC_X86
+void fhstripessse2(uint64_t* acc, const byte* p, int n, int s) {
+    const byte* sec = fhsecret() + 8 * s;
+    __m128i* a = (__m128i*)acc;
+    __m128i a0 = _mm_loadu_si128(a), a1 = _mm_loadu_si128(a + 1), a2 = _mm_loadu_si128(a + 2), a3 = _mm_loadu_si128(a + 3);
+    auto lane = [](__m128i acc, const byte* p, const byte* sec) {
+        __m128i data = _mm_loadu_si128((const __m128i*)p);
+        __m128i key = _mm_xor_si128(data, _mm_loadu_si128((const __m128i*)sec));
+        __m128i prod = _mm_mul_epu32(key, _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1)));
+        return _mm_add_epi64(_mm_add_epi64(acc, _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2))), prod);
+    };
+    for (int k = 0; k < n; k++, p += FH_STRIPE, sec += 8) {
+        a0 = lane(a0, p, sec);
+        a1 = lane(a1, p + 16, sec + 16);
+        a2 = lane(a2, p + 32, sec + 32);
+        a3 = lane(a3, p + 48, sec + 48);
+    }
+    _mm_storeu_si128(a, a0);
+    _mm_storeu_si128(a + 1, a1);
+    _mm_storeu_si128(a + 2, a2);
+    _mm_storeu_si128(a + 3, a3);
+}
+AVX2_TARGET void fhstripesavx2(uint64_t* acc, const byte* p, int n, int s) {
+    const byte* sec = fhsecret() + 8 * s;
+    __m256i* a = (__m256i*)acc;
+    __m256i a0 = _mm256_loadu_si256(a), a1 = _mm256_loadu_si256(a + 1);
+    for (int k = 0; k < n; k++, p += FH_STRIPE, sec += 8) {
+        __m256i d0 = _mm256_loadu_si256((const __m256i*)p), d1 = _mm256_loadu_si256((const __m256i*)(p + 32));
+        __m256i k0 = _mm256_xor_si256(d0, _mm256_loadu_si256((const __m256i*)sec));
+        __m256i k1 = _mm256_xor_si256(d1, _mm256_loadu_si256((const __m256i*)(sec + 32)));
+        __m256i p0 = _mm256_mul_epu32(k0, _mm256_shuffle_epi32(k0, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m256i p1 = _mm256_mul_epu32(k1, _mm256_shuffle_epi32(k1, _MM_SHUFFLE(0, 3, 0, 1)));
+        a0 = _mm256_add_epi64(_mm256_add_epi64(a0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2))), p0);
+        a1 = _mm256_add_epi64(_mm256_add_epi64(a1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2))), p1);
+    }
+    _mm256_storeu_si256(a, a0);
+    _mm256_storeu_si256(a + 1, a1);
+}
+
+AVX2_TARGET inline __m256i fhscrambleavx2(__m256i x, __m256i key, __m256i prime) {
+    x = _mm256_xor_si256(_mm256_xor_si256(x, _mm256_srli_epi64(x, 47)), key);
+    __m256i lo = _mm256_mul_epu32(x, prime);
+    __m256i hi = _mm256_mul_epu32(_mm256_shuffle_epi32(x, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+}
+//whole blocks without leaving the registers, scramble included
+AVX2_TARGET void fhblocksavx2(uint64_t* acc, const byte* p, int64 n) {
+    const byte* secret = fhsecret();
+    __m256i* a = (__m256i*)acc;
+    __m256i a0 = _mm256_loadu_si256(a), a1 = _mm256_loadu_si256(a + 1);
+    const __m256i s0 = _mm256_loadu_si256((const __m256i*)(secret + FH_SECRET - FH_STRIPE));
+    const __m256i s1 = _mm256_loadu_si256((const __m256i*)(secret + FH_SECRET - FH_STRIPE + 32));
+    const __m256i prime = _mm256_set1_epi32((int)FH_P32_1);
+    for (; n--;) {
+        const byte* sec = secret;
+        for (int k = 0; k < FH_STRIPES; k++, p += FH_STRIPE, sec += 8) {
+            __m256i d0 = _mm256_loadu_si256((const __m256i*)p), d1 = _mm256_loadu_si256((const __m256i*)(p + 32));
+            __m256i k0 = _mm256_xor_si256(d0, _mm256_loadu_si256((const __m256i*)sec));
+            __m256i k1 = _mm256_xor_si256(d1, _mm256_loadu_si256((const __m256i*)(sec + 32)));
+            __m256i p0 = _mm256_mul_epu32(k0, _mm256_shuffle_epi32(k0, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m256i p1 = _mm256_mul_epu32(k1, _mm256_shuffle_epi32(k1, _MM_SHUFFLE(0, 3, 0, 1)));
+            a0 = _mm256_add_epi64(_mm256_add_epi64(a0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2))), p0);
+            a1 = _mm256_add_epi64(_mm256_add_epi64(a1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2))), p1);
+        }
+        a0 = fhscrambleavx2(a0, s0, prime);
+        a1 = fhscrambleavx2(a1, s1, prime);
+    }
+    _mm256_storeu_si256(a, a0);
+    _mm256_storeu_si256(a + 1, a1);
+}
+void fhblockssse2(uint64_t* acc, const byte* p, int64 n) {
+    for (; n--; p += FH_BLOCK) {
+        fhstripessse2(acc, p, FH_STRIPES, 0);
+        fhscramble(acc);
+    }
+}
+
+inline bool hasavx2() {
+    static const bool has = [] {
+        uint regs[4] = { 0, 0, 0, 0 };
+#ifdef _MSC_VER
+        __cpuid((int*)regs, 1);
+        if (!(regs[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6) return false; //osxsave + ymm state
+        __cpuidex((int*)regs, 7, 0);
+#else
+        if (!__get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]) || !(regs[2] & (1 << 27))) return false;
+        uint lo, hi;
+        __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        if ((lo & 6) != 6) return false;
+        __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+        return (regs[1] & (1 << 5)) != 0;
+    }();
+    return has;
+}
+#endif
+
+inline void (*fhkernel())(uint64_t*, const byte*, int, int) {
+#ifdef FASTCRC_X86
+    static void (*const k)(uint64_t*, const byte*, int, int) = hasavx2() ? fhstripesavx2 : fhstripessse2;
+    return k;
+#else
+    return fhstripes;
+#endif
+}
+inline void (*fhblockkernel())(uint64_t*, const byte*, int64) {
+#ifdef FASTCRC_X86
+    static void (*const k)(uint64_t*, const byte*, int64) = hasavx2() ? fhblocksavx2 : fhblockssse2;
+    return k;
+#else
+    return fhblocks;
+#endif
+}
+
+inline uint64_t fhavalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+inline uint64_t fhmulfold(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 r = (unsigned __int128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    uint64_t hi, lo = _umul128(a, b, &hi);
+    return lo ^ hi;
+#else
+    uint64_t lolo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF), hilo = (a >> 32) * (b & 0xFFFFFFFF);
+    uint64_t lohi = (a & 0xFFFFFFFF) * (b >> 32), hihi = (a >> 32) * (b >> 32);
+    uint64_t cross = (lolo >> 32) + (hilo & 0xFFFFFFFF) + lohi;
+    return ((cross << 32) | (lolo & 0xFFFFFFFF)) ^ (hihi + (hilo >> 32) + (cross >> 32));
+#endif
+}
+
+struct FastHash {
+    FastHash() {
+        const uint64_t init[8] = { FH_P32_3, FH_P64_1, FH_P64_2, FH_P64_3, FH_P64_4, FH_P32_2, FH_P64_5, FH_P32_1 };
+        memcpy(acc, init, sizeof(acc));
+    }
+    void update(const void* data, int64 size) {
+        const byte* p = (const byte*)data;
+        total += size;
+        if (buffered) { //top up the partial block first
+            int64 take = MIN(FH_BLOCK - buffered, size);
+            memcpy(buf + buffered, p, take);
+            buffered += (int)take;
+            p += take;
+            size -= take;
+            if (buffered < FH_BLOCK) return;
+            fhblockkernel()(acc, buf, 1);
+            buffered = 0;
+        }
+        int64 n = size / FH_BLOCK;
+        if (n) fhblockkernel()(acc, p, n);
+        p += n * FH_BLOCK;
+        size -= n * FH_BLOCK;
+        if (size) memcpy(buf, p, size);
+        buffered = (int)size;
+    }
+    //lo is the 64 bit hash, lo+hi together the 128 bit one
+    void digest(uint64_t& lo, uint64_t& hi) const {
+        uint64_t a[8];
+        memcpy(a, acc, sizeof(a));
+        int full = buffered / FH_STRIPE, rem = buffered % FH_STRIPE;
+        if (full) fhkernel()(a, buf, full, 0);
+        if (rem) { //zero padded last stripe, the length below keeps it apart from real zeroes
+            byte last[FH_STRIPE] = { 0 };
+            memcpy(last, buf + full * FH_STRIPE, rem);
+            fhkernel()(a, last, 1, full);
+        }
+        lo = merge(a, 11, (uint64_t)total * FH_P64_1);
+        hi = merge(a, FH_SECRET - FH_STRIPE - 11, ~((uint64_t)total * FH_P64_2));
+    }
+
+    uint64_t acc[8];
+    alignas(64) byte buf[FH_BLOCK];
+    int buffered = 0;
+    int64 total = 0;
+private:
+    static uint64_t merge(const uint64_t* a, int off, uint64_t start) {
+        const byte* sec = fhsecret() + off;
+        for (int i = 0; i < 4; i++) start += fhmulfold(a[2 * i] ^ read64(sec + 16 * i), a[2 * i + 1] ^ read64(sec + 16 * i + 8));
+        return fhavalanche(start);
+    }
+};
+
+uint64_t fasthash64(const void* data, int64 size) {
+    FastHash h;
+    h.update(data, size);
+    uint64_t lo, hi;
+    h.digest(lo, hi);
+    return lo;
+}
+
+//CHECKSUMS
+//which hash a patch uses for its checksums, crc32 is what older patches have
+#define HASH_CRC32 0
+#define HASH_FAST64 1
+#define HASH_FAST128 2
+#define HASH_COUNT 3
+static byte hashalgo = HASH_CRC32;
+
+inline int hashsize(byte algo = hashalgo) { return algo == HASH_FAST128 ? 16 : algo == HASH_FAST64 ? 8 : 4; }
+
+struct Digest {
+    uint64_t lo = 0, hi = 0;
+    bool operator==(const Digest& o) const { return lo == o.lo && hi == o.hi; }
+    bool operator!=(const Digest& o) const { return !(*this == o); }
+};
+
+//TREE HASH
+//past one FH_CHUNK the input is hashed a chunk at a time on the worker threads and the chunk digests are
+//hashed together with the length. the chunk size is fixed so the value doesn't depend on how many threads
+//ran, and anything up to one chunk hashes the same as a plain FastHash
+#define FH_CHUNK 0x400000 //4MB per task
+
+struct FastTree {
+    void update(const void* data, int64 size) {
+        const byte* p = (const byte*)data;
+        if (inleaf) { //finish the partial chunk first
+            int64 take = MIN(FH_CHUNK - inleaf, size);
+            leaf.update(p, take);
+            inleaf += take;
+            total += take;
+            p += take;
+            size -= take;
+            if (inleaf < FH_CHUNK) return;
+            Digest d;
+            leaf.digest(d.lo, d.hi);
+            push(d);
+            leaf = FastHash();
+            inleaf = 0;
+        }
+        int64 n = size / FH_CHUNK;
+        if (n) addchunks(n, [&](int64 i, Digest& d) {
+            FastHash h;
+            h.update(p + i * FH_CHUNK, FH_CHUNK);
+            h.digest(d.lo, d.hi);
+        });
+        p += n * FH_CHUNK;
+        size -= n * FH_CHUNK;
+        leaf.update(p, size);
+        inleaf = size;
+        total += size;
+    }
+    //n whole chunks, leafof(i, d) hashes the i-th into d on a worker. only between chunks
+    template <typename F>
+    void addchunks(int64 n, F leafof) {
+        std::vector<Digest> parts(n);
+        parallelfor(n, [&](int64 i) { leafof(i, parts[i]); });
+        for (const Digest& d : parts) push(d);
+        total += n * FH_CHUNK;
+    }
+    void digest(uint64_t& lo, uint64_t& hi) const {
+        if (!leaves) return leaf.digest(lo, hi);
+        if (leaves == 1 && !inleaf) {
+            lo = first.lo;
+            hi = first.hi;
+            return;
+        }
+        FastHash r = root;
+        if (inleaf) {
+            Digest d;
+            leaf.digest(d.lo, d.hi);
+            r.update(&d.lo, 8);
+            r.update(&d.hi, 8);
+        }
+        r.update(&total, 8);
+        r.digest(lo, hi);
+    }
+
+    FastHash leaf, root;
+    int64 inleaf = 0, leaves = 0, total = 0;
+    Digest first;
+private:
+    void push(const Digest& d) {
+        if (!leaves++) first = d;
+        root.update(&d.lo, 8);
+        root.update(&d.hi, 8);
+    }
+};
+
+//incremental checksum with whichever algorithm the patch uses
+struct Hasher {
+    Hasher(byte a = hashalgo) : algo{ a } {}
+    void update(const void* data, int64 size) {
+        if (algo == HASH_CRC32) crc = crc32par(data, size, crc);
+        else fh.update(data, size);
+    }
+    Digest digest() const {
+        Digest d;
+        if (algo == HASH_CRC32) d.lo = crc;
+        else {
+            fh.digest(d.lo, d.hi);
+            if (algo == HASH_FAST64) d.hi = 0;
+        }
+        return d;
+    }
+    byte algo;
+    uint crc = 0;
+    FastTree fh;
+};
+
+Digest hashbuf(const void* data, int64 size, byte algo = hashalgo) {
+    Hasher h(algo);
+    h.update(data, size);
+    return h.digest();
+}
+
+//false if the file can't be opened or is shorter than size
+bool hashfile(const std::string& path, int64 size, Digest& d, byte algo = hashalgo) {
+    d = Digest();
+    if (algo == HASH_CRC32) {
+        uint crc;
+        bool ok = crc32file(path, size, crc);
+        d.lo = crc;
+        return ok;
+    }
+    //whole chunks are each read through their own handle like crc32file does, the tail after them here
+    Hasher h(algo);
+    std::atomic<bool> ok(true);
+    int64 whole = size > FH_CHUNK ? size / FH_CHUNK : 0;
+    if (whole) h.fh.addchunks(whole, [&](int64 i, Digest& c) {
+        static thread_local charvec buf(0x100000);
+        std::ifstream f(path, std::ios::binary | std::ios::in);
+        FastHash part;
+        int64 left = FH_CHUNK;
+        f.seekg(i * FH_CHUNK);
+        while (left > 0 && f.read((char*)buf.data(), MIN(buf.size(), left)).gcount()) {
+            part.update(buf.data(), f.gcount());
+            left -= f.gcount();
+        }
+        if (left > 0) ok = false;
+        part.digest(c.lo, c.hi);
+    });
+    size -= whole * FH_CHUNK;
+    charvec buf(MIN(size, FH_CHUNK));
+    std::ifstream f(path, std::ios::binary | std::ios::in);
+    if (!f) return false;
+    f.seekg(whole * FH_CHUNK);
+    while (size > 0 && f.read((char*)buf.data(), MIN(buf.size(), size)).gcount()) {
+        h.update(buf.data(), f.gcount());
+        size -= f.gcount();
+    }
+    d = h.digest();
+    return ok && size <= 0;
+}
+
+void writedigest(charvec& vector, const Digest& d, byte algo = hashalgo) {
+    int size = hashsize(algo);
+    writeint(vector, d.lo, MIN(size, 8));
+    if (size > 8) writeint(vector, d.hi, size - 8);
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include "util.h"
+#include "threads.h"
+#include <sys/stat.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+//STORAGE ORDER
+//lots of small files read in name order means a seek per file on spinning disks and cold network
+//filesystems. work lists get sorted by where each file's data sits instead: the first extent's physical
+//offset when FIEMAP reports it, else the inode number, which most filesystems hand out roughly in
+//allocation order. workers also tell the kernel about the next few files so they're read in while the
+//current ones are diffed or patched
+static int prefetch = 8; //how many files ahead of the workers to ask for, 0 is off
+#define IO_BIGFILE 0x800000 //8MB, past this reading a file costs more than finding it
+
+#ifdef __linux__
+//first extent's physical offset, 0 for a file with no data. false if the filesystem won't say
+inline bool extentof(const std::string& path, uint64_t& at) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    alignas(8) char buf[sizeof(fiemap) + sizeof(fiemap_extent)] = {};
+    fiemap* fm = (fiemap*)buf;
+    fm->fm_length = FIEMAP_MAX_OFFSET;
+    fm->fm_extent_count = 1;
+    struct stat f;
+    bool ok = !fstat(fd, &f) && !ioctl(fd, FS_IOC_FIEMAP, fm);
+    close(fd);
+    if (!ok) return false;
+    at = 0;
+    if (!fm->fm_mapped_extents) return !f.st_size; //data that isn't placed yet has no address either
+    //neither do inline, packed and delayed extents
+    if (fm->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DELALLOC)) return false;
+    at = fm->fm_extents[0].fe_physical;
+    return true;
+}
+
+inline void prefetchfile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED); //starts the reads and returns, the page cache holds on to them
+    close(fd);
+}
+#else
+inline bool extentof(const std::string&, uint64_t&) { return false; }
+inline void prefetchfile(const std::string&) {}
+#endif
+
+//disk keys for paths[i], inodes[i] (looked up when not given). physical offsets only if every file with
+//data has one, the two don't mix. an empty path is a file that doesn't get read and keeps key 0
+std::vector<uint64_t> diskkeys(const std::vector<std::string>& paths, const std::vector<uint64_t>& inodes = {}) {
+    using namespace std;
+    vector<uint64_t> keys(paths.size());
+    atomic<bool> physical(true);
+    parallelfor(paths.size(), [&](int64 i) {
+        if (physical && paths[i].size() && !extentof(paths[i], keys[i])) physical = false;
+    });
+    if (physical) return keys;
+    parallelfor(paths.size(), [&](int64 i) {
+        struct stat f;
+        if (paths[i].empty()) keys[i] = 0;
+        else if (i < (int64)inodes.size()) keys[i] = inodes[i];
+        else keys[i] = stat(paths[i].c_str(), &f) ? 0 : f.st_ino;
+    });
+    return keys;
+}
+
+//stable sorts order[from, to) by keys[order[i]], so ties and files with no key stay as they were
+inline void storageorder(std::vector<size_t>& order, const std::vector<uint64_t>& keys, size_t from = 0, size_t to = SIZE_MAX) {
+    to = std::min(to, order.size());
+    if (from < to) std::stable_sort(order.begin() + from, order.begin() + to, [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+}
+
+//shared by the workers of one parallelfor: before item k, at(k) makes sure the next prefetch items have
+//been asked for. fetch(i) calls prefetchfile on whatever item i reads
+template <typename F>
+struct Readahead {
+    Readahead(int64 count, F fetch) : count{ count }, fetch{ fetch } {}
+    void at(int64 k) {
+        int64 to = std::min(k + 1 + prefetch, count), from;
+        {
+            std::lock_guard<std::mutex> l(m);
+            from = std::max(issued, k + 1);
+            if (from >= to) return;
+            issued = to;
+        }
+        for (int64 i = from; i < to; i++) fetch(i);
+    }
+    int64 count;
+    F fetch;
+    std::mutex m;
+    int64 issued = 0;
+};
+template <typename F>
+Readahead<F> readahead(int64 count, F fetch) { return Readahead<F>(count, fetch); }
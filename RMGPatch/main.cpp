@@ -4,13 +4,20 @@
 #include <iterator>
 #include <random>
 #include <array>
+#include <unordered_map>
 #include "util.h"
+#include "fasthash.h"
+#include "dirscan.h"
+#include "mapfile.h"
+#include "manifest.h"
+#include "sketch.h"
+#include "iosched.h"
+#include "aio.h"
+#include "stage.h"
 
-#define CRCPP_USE_CPP11
 #ifdef _WIN32
 #define ZLIB_WINAPI 
 #endif
-#include "dependencies/CRC.h"
 #include "dependencies/zlib/zlib.h"
 #include "dependencies/lzma/LzmaLib.h"
 
@@ -23,16 +30,44 @@ static int chsize = 0x800;
 #endif
 static int lensize = 0x200;
 
-static int bytecount[3] = {0, 0, 0};
+static thread_local int bytecount[3] = {0, 0, 0};
+static thread_local std::ostream* logto = &std::cout; //workers point this at their own buffer
+static thread_local int64 patchbudget = -1; //createpatch gives up once this much is unmatched or written, -1 never
+static thread_local bool overbudget = false; //and says so here
 static bool include[3] = {1, 1, 1};
+static std::string manifestpath; //quick skip cache for directory create, off when empty
+static int solidmb = 0; //directory create packs plain additions together in blocks of about this many MB, 0 is off
+static std::vector<std::string> only; //directory apply only touches paths matching one of these, all when empty
+
+//feature flags, kept in the low bits of the 4th header byte (0x80 marks a directory patch)
+#define PF_BLOCKS 0x01 //per block checksums of the original and a checksum for every replacement payload
+#define PF_TARGET 0x02 //checksum of the edited file, checked against the output before anything gets written
+#define PF_HASH   0x04 //a byte after the magic says which hash all the checksums use, crc32 otherwise
+#define PF_MOVES  0x08 //directory patches only, the header has moved entries
+#define PF_INDEX  0x10 //directory patches only, the header comes after the files with its offset in the last 8 bytes
+#define PF_PATHS  0x20 //directory patches only, a sorted path index follows the trailing header
+#define PF_COMPACT 0x40 //directory patches only, the header is a compact one (varints, front coded names, maybe packed)
+#define PF_KNOWN  (PF_BLOCKS | PF_TARGET | PF_HASH | PF_MOVES | PF_INDEX | PF_PATHS | PF_COMPACT)
+//high nibble of a compact header's packing byte, the pflags ran out
+#define HF_TREES  0x10 //subtree entries
+#define HF_REPLACED 0x20 //changed files stored whole
+#define HF_KNOWN  (HF_TREES | HF_REPLACED)
+#define SUBTREE_MAX ((int64)256 << 20) //an added dir bigger than this goes in file by file
+//changed files: one the original has less than this share of (going by a sample) isn't diffed at all, and a diff
+//that's left more than REPLACE_BUDGET of the file unmatched stops there. either way the file's stored whole
+#define REPLACE_MINSIZE 0x10000 //64KB, below this diffing is cheap enough to just try
+#define REPLACE_MINSHARE 0.125
+#define REPLACE_BUDGET(size) ((size) * 7 / 8)
+static byte pflags = 0;
+static byte blockshift = 24; //log2 of the block size, 16MB by default
 
 void showhelp() {
     using namespace std;
     cout <<
-        "usage: pt <command> [<args>] [--memory=X] [--include(a/r/d)=y]" << endl <<
+        "usage: pt <command> [<args>] [--memory=X] [--threads=0] [--include(a/r/d)=y]" << endl <<
         "commands:" << endl <<
         "      create         - creates a patch out of 2 files or directories" << endl <<
-        "        <original> <edited> <patchfile> [--crccmp=n] [--chsize=0x800] [--lensize=0x200]" << endl <<
+        "        <original> <edited> <patchfile> [--crccmp=n] [--chsize=0x800] [--lensize=0x200] [--blocks=0] [--target=n] [--hash=crc32] [--manifest=file] [--solid=0]" << endl <<
         "      apply          - applies a patch to a file or directory" << endl <<
         "        <original> <patchfile> [output]" << endl <<
         "        output will not be used for directories" << endl <<
@@ -45,12 +80,38 @@ void showhelp() {
         "        only accepts integer values (no hex.) defaults to 0x200 (512)" << endl <<
         "    --crccmp         - compare files with CRC-32 to check if they are the same instead of attempting to make" << endl <<
         "        a patch to see if they're the same. this is slower and more memory intensive. defaults to n" << endl <<
+        "    --blocks         - store a checksum for every X MB of the original (rounded up to a power of 2)" << endl <<
+        "        and for every replacement so applying only checks what it reads and can say where it failed. defaults to 0 (off)" << endl <<
+        "    --target         - store a checksum of the edited file so applying can verify its output while writing it. defaults to n" << endl <<
+        "    --manifest       - directory create only. keeps a hash of every file it reads in this file, keyed by path, size," << endl <<
+        "        mtime and inode, and skips files whose size and cached hash match without reading them. updated every run" << endl <<
+        "    --solid          - directory create only. compress added files together in blocks of about this many MB instead of" << endl <<
+        "        one by one, sorted so files of a kind sit together. blocks are unpacked in parallel. defaults to 0 (off)" << endl <<
+        "    --hash           - which hash to use for all the checksums in the patch: crc32, fast64 or fast128." << endl <<
+        "        the fast ones are much quicker and much less likely to miss a change on big files. defaults to crc32" << endl <<
+        "    --threads        - how many worker threads to use for checksumming and for diffing the files of a directory." << endl <<
+        "        the patch comes out the same no matter the count. defaults to one per core" << endl <<
+        "    --prefetch       - directory patches. files are read in the order they sit on disk, and this many ahead of the" << endl <<
+        "        workers are asked for so they're read in while others are being worked on. 0 for none, defaults to 8" << endl <<
+        "    --uring(y/n)     - directory patches, linux. small files are read and written through an io_uring, many at once" << endl <<
+        "        and each handed to a worker as it comes in. falls back to the workers doing it when there's none. defaults to y" << endl <<
         "    --include(a/r/d) - includea, includer, included; a for additions, r for removals, and d for changed files" << endl <<
-        "        this can be used for both creation and applying directory patches. all default to y" << endl;
+        "        this can be used for both creation and applying directory patches. all default to y" << endl <<
+        "    --only           - directory apply only. only patch paths matching this glob, can be given more than once." << endl <<
+        "        * and ? stay within a directory, ** doesn't. looked up in the patch's path index without reading the rest." << endl <<
+        "        a directory added or removed whole is only patched by a glob that takes all of it, like dir/**" << endl <<
+        "    --stage(y/n)     - directory apply only. every file is written next to where it goes first, then they're all synced" << endl <<
+        "        at once and renamed into place, so a crash can't leave one half written. defaults to n" << endl;
 }
 
-charvec createpatch(std::ifstream ogfile, std::ifstream edfile, bool header, uint crc = 0);
+charvec createpatch(std::ifstream ogfile, std::ifstream edfile, bool header, Digest crc = Digest());
+charvec createpatch(byte* og, int64 ogmax, byte* ed, int64 edmax, bool header, Digest crc);
+byte packbest(const byte* data, int64 size, charvec& out, byte* props);
+bool unpackbest(const byte* data, int64 size, byte used, const byte* props, byte* out, int64 outsize);
+charvec packblock(const charvec& raw);
+bool unpackblock(ByteView from, int64 at, charvec& raw);
 charvec applypatch(std::ifstream ogfile, std::ifstream ptfile, bool header, int& code);
+charvec applypatch(byte* og, int64 ogmax, byte* pt, int64 ptmax, bool header, int& code);
 
 int main(int argc, char* argv[]) {
     #if defined(_WIN32) && defined(_DEBUG)
@@ -88,10 +149,27 @@ int main(int argc, char* argv[]) {
                     include[target] = argv[i][10] == 'y';
                     continue;   
                 }
+                if (!create && !strncmp("--stage", argv[i], 7)) {
+                    staging = argv[i][8] == 'y';
+                    continue;
+                }
+                if (!create && !strncmp("--only", argv[i], 6)) {
+                    only.push_back(argv[i] + 7);
+                    continue;
+                }
             }
             if (!strncmp("--memory", argv[i], 8)) {
                 memory = argv[i][9] == 'y';
             }
+            else if (!strncmp("--threads", argv[i], 9)) {
+                threads = atoi(argv[i] + 10);
+            }
+            else if (!strncmp("--uring", argv[i], 7)) {
+                uring = argv[i][8] == 'y';
+            }
+            else if (!strncmp("--prefetch", argv[i], 10)) {
+                prefetch = MAX(atoi(argv[i] + 11), 0);
+            }
             else if (!strncmp("--verbose", argv[i], 9)) {
                 verbose = argv[i][10] == 'y';
             }
@@ -112,8 +190,33 @@ int main(int argc, char* argv[]) {
                         lensize += (buf[j] - 0x30);
                     }
                 }
+                else if (!strncmp("--blocks", argv[i], 8)) {
+                    int mb = atoi(argv[i] + 9);
+                    if (mb > 0) {
+                        pflags |= PF_BLOCKS;
+                        for (blockshift = 20; ((int64)1 << (blockshift - 20)) < mb; blockshift++);
+                    }
+                }
+                else if (!strncmp("--target", argv[i], 8)) {
+                    if (argv[i][9] == 'y') pflags |= PF_TARGET;
+                    else pflags &= ~PF_TARGET;
+                }
+                else if (!strncmp("--hash", argv[i], 6)) {
+                    if (!strcmp(argv[i] + 7, "crc32")) hashalgo = HASH_CRC32;
+                    else if (!strcmp(argv[i] + 7, "fast64")) hashalgo = HASH_FAST64;
+                    else if (!strcmp(argv[i] + 7, "fast128")) hashalgo = HASH_FAST128;
+                    else std::cout << "invalid hash " << argv[i] + 7 << std::endl;
+                    if (hashalgo != HASH_CRC32) pflags |= PF_HASH;
+                    else pflags &= ~PF_HASH;
+                }
                 else if (!strncmp("--crccmp", argv[i], 8)) {
-                    verbose = argv[i][10] == 'y';
+                    docompare = argv[i][9] == 'y';
+                }
+                else if (!strncmp("--manifest", argv[i], 10)) {
+                    manifestpath = argv[i] + 11;
+                }
+                else if (!strncmp("--solid", argv[i], 7)) {
+                    solidmb = MAX(atoi(argv[i] + 8), 0);
                 }
             }
             else std::cout << "invalid switch " << argv[i] << std::endl;
@@ -132,12 +235,12 @@ int main(int argc, char* argv[]) {
                 printf("invalid folder %s\n", argv[3]);
                 return 2;
             }
-            unique_ptr<Dir> rootdir[2];
+            unique_ptr<DirTree> rootdir[2];
             string rootstr[2];
-            for (int i = 0; i < 2; i++) {
-                rootstr[i] = argv[i+2];
-                rootdir[i] = filesystodir(rootstr[i]);
-            }
+            for (int i = 0; i < 2; i++) rootstr[i] = argv[i+2];
+            int64 stamp = scanstamp();
+            filesystodirs(rootstr, rootdir, 2);
+            if (!rootdir[0] || !rootdir[1]) return 2;
             //both of our dirs are ready now we need to find the differences
             vector<string> walked[2];
             for (int i = 0; i < 2; i++) {
@@ -150,140 +253,755 @@ int main(int argc, char* argv[]) {
             if (include[2]) set_difference(walked[0].begin(), walked[0].end(), walked[1].begin(), walked[1].end(), back_inserter(onlyin[0]));
             if (include[1]) set_difference(walked[1].begin(), walked[1].end(), walked[0].begin(), walked[0].end(), back_inserter(onlyin[1]));
             if (include[0]) set_intersection(walked[0].begin(), walked[0].end(), walked[1].begin(), walked[1].end(), back_inserter(shared));
-            charvec outbuf, dirhead; //AND SO WE BEGIN
-            unique_ptr<Dir> dwritten = unique_ptr<Dir>(new Dir());
-            vector<array<int64, 2>> inb;
-            for (const string& str : shared) {
-                for (int i = 0; i < 3; i++) bytecount[i] = 0;
-                cout << str << endl;
+            charvec dirhead; //AND SO WE BEGIN
+            unique_ptr<DirTree> dwritten = unique_ptr<DirTree>(new DirTree());
+            //files go straight to the patch as they're done, the header only gets written once they all are.
+            //positions are from the end of the magic
+            ofstream out(argv[4], ios::binary | ios::out | ios::trunc);
+            if (!out) {
+                cout << "unable to open " << argv[4] << endl;
+                return 1;
+            }
+            Byte dirflags = 0x80 | PF_INDEX | PF_PATHS | PF_COMPACT;
+            charvec h({ 'X', 'X', 'X', (Byte)(dirflags | pflags) });
+            out.write((char*)h.data(), 4);
+            if (pflags & PF_HASH) out.put(hashalgo);
+            int64 body = 0;
+            auto emit = [&](const charvec& v) {
+                int64 at = body;
+                out.write((char*)v.data(), v.size());
+                body += v.size();
+                return at;
+            };
+            //diff everything on the workers, biggest files first so one huge file doesn't start last,
+            //then write them in that order and merge in walklist order so the patch is the same no matter how
+            //many threads ran
+            vector<int64> sizes[2];
+            vector<Dir*> nodes[2];
+            for (const string& str : shared)
+                for (int i = 0; i < 2; i++) {
+                    nodes[i].push_back(rootdir[i]->find(str, false));
+                    sizes[i].push_back(nodes[i].back()->filesize);
+                }
+            //quick skip: a file whose size and cached hash match on both sides is identical without reading either
+            Manifest manifest;
+            bool quick = manifestpath.size();
+            string mroot[2];
+            vector<Byte> skip(shared.size());
+            vector<array<Digest, 2>> mhash(shared.size());
+            if (quick) {
+                manifest.load(manifestpath);
+                for (int i = 0; i < 2; i++) mroot[i] = filesystem::absolute(rootstr[i]).generic_string();
+                for (size_t j = 0; j < shared.size(); j++) {
+                    const ManifestEntry* e[2];
+                    for (int i = 0; i < 2; i++) e[i] = manifest.lookup(mroot[i] + shared[j], nodes[i][j]);
+                    if (e[0] && e[1] && sizes[0][j] == sizes[1][j] && e[0]->hash == e[1]->hash) {
+                        skip[j] = true;
+                        for (int i = 0; i < 2; i++) mhash[j][i] = e[i]->hash;
+                    }
+                }
+            }
+            vector<size_t> order(shared.size());
+            for (size_t i = 0; i < order.size(); i++) order[i] = i;
+            stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return MAX(sizes[0][a], sizes[1][a]) > MAX(sizes[0][b], sizes[1][b]); });
+            //past the big ones finding a file costs more than reading it, so the rest go in the order they sit on disk
+            size_t big = 0;
+            while (big < order.size() && MAX(sizes[0][order[big]], sizes[1][order[big]]) >= IO_BIGFILE) big++;
+            //the patch keeps the size order though, so the same trees make the same patch wherever they sit
+            vector<size_t> canon = order, place(shared.size());
+            for (size_t i = 0; i < canon.size(); i++) place[canon[i]] = i;
+            {
+                vector<string> paths(shared.size());
+                vector<uint64_t> inodes(shared.size());
+                for (size_t j = 0; j < shared.size(); j++) {
+                    if (!skip[j]) paths[j] = rootstr[0] + shared[j];
+                    inodes[j] = nodes[0][j]->inode;
+                }
+                storageorder(order, diskkeys(paths, inodes), big);
+            }
+            vector<charvec> results(shared.size());
+            vector<string> logs(shared.size());
+            vector<Byte> replaced(shared.size()), unread(shared.size());
+            //written in size order as soon as everything before is, so only what finished early waits in memory
+            vector<int64> at(shared.size()), lens(shared.size());
+            vector<Byte> ready(order.size());
+            size_t flushed = 0;
+            mutex flushlock;
+            auto finish = [&](int64 k) {
+                lock_guard<mutex> l(flushlock);
+                ready[place[order[k]]] = true;
+                for (; flushed < canon.size() && ready[flushed]; flushed++) {
+                    size_t j = canon[flushed];
+                    lens[j] = results[j].size();
+                    if (lens[j]) at[j] = emit(results[j]);
+                    results[j] = charvec();
+                }
+            };
+            //loaded is both files when the ring already read them
+            auto diffone = [&](int64 k, const charvec* loaded) {
+                size_t j = order[k];
+                if (skip[j]) return;
+                ostringstream log;
+                logto = &log;
                 string fpath[2];
-                for (int i = 0; i < 2; i++) fpath[i] = rootstr[i] + str;
-                ifstream og(fpath[0], ios::binary | ios::in);
-                ifstream ed(fpath[1], ios::binary | ios::in);
-                int ogfs = rootdir[0]->find(str, false)->filesize;
-                int edfs = rootdir[1]->find(str, false)->filesize;
-                char* ogb = new char[ogfs];
-                og.read(ogb, ogfs);
-                uint c = CRC::Calculate(ogb, ogfs, CRC::CRC_32());
-                delete[] ogb;
-                og.close();
-                if (docompare && ogfs == edfs) {
-                    char* edb = new char[ogfs];
-                    ed.read(edb, ogfs);
-                    uint edc = CRC::Calculate(edb, ogfs, CRC::CRC_32());
-                    delete[] edb;
-                    if (c == edc) {
-                        cout << " identical" << endl;
-                        continue;
+                for (int i = 0; i < 2; i++) fpath[i] = rootstr[i] + shared[j];
+                //one view per file feeds the checksum, the compare and the diff, so every byte comes off disk once
+                static const Byte none = 0;
+                unique_ptr<MappedFile> maps[2];
+                ByteView view[2];
+                for (int i = 0; i < 2; i++) {
+                    if (loaded) view[i] = ByteView(loaded[i].size() ? loaded[i].data() : &none, loaded[i].size());
+                    else {
+                        maps[i].reset(new MappedFile(fpath[i]));
+                        view[i] = ByteView(maps[i]->data, maps[i]->size);
                     }
                 }
-                ed.close();
-                charvec r = createpatch(ifstream(fpath[0], ios::binary | ios::in), ifstream(fpath[1], ios::binary | ios::in), false, c);
-                if (!r.size()) {
+                bool mapped = view[0].data && view[1].data;
+                bool readok = true;
+                auto filehash = [&](int i, Byte algo) {
+                    Digest d;
+                    readok &= hashfile(fpath[i], sizes[i][j], d, algo);
+                    return d;
+                };
+                Digest c;
+                bool same;
+                if (quick) { //with the manifest on the compare is always done, on the hashes it keeps
+                    for (int i = 0; i < 2; i++)
+                        mhash[j][i] = mapped ? hashbuf(view[i].data, view[i].size, HASH_FAST128) : filehash(i, HASH_FAST128);
+                    if (hashalgo == HASH_FAST128) c = mhash[j][0];
+                    else c = mapped ? hashbuf(view[0].data, view[0].size) : filehash(0, hashalgo);
+                    same = sizes[0][j] == sizes[1][j] && mhash[j][0] == mhash[j][1];
+                }
+                else if (mapped) {
+                    c = hashbuf(view[0].data, view[0].size);
+                    same = docompare && view[0].size == view[1].size && !memcmp(view[0].data, view[1].data, view[0].size);
+                }
+                else {
+                    c = filehash(0, hashalgo);
+                    same = docompare && sizes[0][j] == sizes[1][j] && c == filehash(1, hashalgo);
+                }
+                if (!readok) { //a patch made from part of a file would break it on apply
+                    unread[j] = true;
+                    logto = &cout;
+                    return;
+                }
+                //the whole file packed goes in instead when the diff gave up or came out bigger
+                bool hopeless = false;
+                auto replace = [&](const Byte* p, int64 size) {
+                    bool must = overbudget || hopeless;
+                    if (!must && (int64)results[j].size() <= size / 2) return;
+                    charvec whole = packblock(charvec(p, p + size));
+                    if (!must && whole.size() >= results[j].size()) return;
+                    results[j].swap(whole);
+                    replaced[j] = true;
+                };
+                overbudget = false;
+                if (!same && mapped) {
+                    inmem = true;
+                    hopeless = view[1].size >= REPLACE_MINSIZE && coverage(view[0].data, view[0].size, view[1].data, view[1].size) < REPLACE_MINSHARE;
+                    if (hopeless) log << " the original has little of it, not diffing" << endl;
+                    else {
+                        patchbudget = REPLACE_BUDGET(view[1].size);
+                        results[j] = createpatch((Byte*)view[0].data, view[0].size, (Byte*)view[1].data, view[1].size, false, c);
+                        patchbudget = -1;
+                    }
+                    replace(view[1].data, view[1].size);
+                }
+                else if (!same) {
+                    patchbudget = REPLACE_BUDGET(sizes[1][j]);
+                    results[j] = createpatch(ifstream(fpath[0], ios::binary | ios::in), ifstream(fpath[1], ios::binary | ios::in), false, c);
+                    patchbudget = -1;
+                    if (overbudget || (int64)results[j].size() > sizes[1][j] / 2) {
+                        ifstream f(fpath[1], ios::binary | ios::in);
+                        charvec v((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+                        replace(v.data(), v.size());
+                    }
+                }
+                if (overbudget) log << " the diff wasn't paying, gave up on it" << endl;
+                logs[j] = log.str();
+                logto = &cout;
+            };
+            //small pairs are read by the ring and diffed once both sides are in, the rest get mapped by the worker
+            bool ring = uringok();
+            auto small = [&](size_t j) { return ring && !skip[j] && MAX(sizes[0][j], sizes[1][j]) <= AIO_SMALL; };
+            vector<array<charvec, 2>> got(order.size());
+            vector<array<Byte, 2>> loaded(order.size());
+            unique_ptr<atomic<int>[]> halves(new atomic<int>[order.size()]());
+            auto ahead = readahead(order.size(), [&](int64 k) {
+                size_t j = order[k];
+                if (!skip[j] && !small(j))
+                    for (int i = 0; i < 2; i++) prefetchfile(rootstr[i] + shared[j]);
+            });
+            loadfiles(order.size() * 2, [&](int64 f) {
+                size_t j = order[f / 2];
+                return small(j) ? rootstr[f % 2] + shared[j] : string();
+            }, [&](int64 f) { return sizes[f % 2][order[f / 2]]; }, [&](int64 f, charvec* data) {
+                int64 k = f / 2;
+                if (data) got[k][f % 2].swap(*data);
+                loaded[k][f % 2] = data != nullptr;
+                if (++halves[k] < 2) return;
+                bool both = loaded[k][0] && loaded[k][1];
+                if (!both) ahead.at(k);
+                diffone(k, both ? got[k].data() : nullptr);
+                got[k] = array<charvec, 2>();
+                finish(k);
+            });
+            //a file that couldn't be read whole would be wrong after the patch, so there's no patch
+            auto giveup = [&](int64 unreadable) {
+                cout << "unable to read " << unreadable << " files, no patch written" << endl;
+                out.close();
+                filesystem::remove(argv[4]);
+                return 2;
+            };
+            int64 unreadable = count(unread.begin(), unread.end(), 1);
+            if (quick && !unreadable) { //a hash of part of a file must never get cached
+                for (size_t j = 0; j < shared.size(); j++)
+                    for (int i = 0; i < 2; i++) manifest.put(mroot[i] + shared[j], nodes[i][j], mhash[j][i]);
+                if (!manifest.save(manifestpath, stamp)) cout << "unable to write manifest " << manifestpath << endl;
+            }
+            for (size_t j = 0; j < shared.size(); j++) {
+                const string& str = shared[j];
+                cout << str << endl << logs[j];
+                if (unread[j]) {
+                    cout << " unable to read" << endl;
+                    continue;
+                }
+                if (!lens[j]) {
                     cout << " identical" << endl;
                     continue;
                 }
                 Dir* dirout = dwritten->find(str, true);
-                dirout->filesize = outbuf.size(); //use filesize as position
+                dirout->filesize = at[j]; //use filesize as position
+                dirout->isdir = false;
+                if (replaced[j]) {
+                    cout << " stored whole" << endl;
+                    dirout->moved = ET_REPLACED;
+                }
+                else dirout->patchlen = lens[j];
+            }
+            if (unreadable) return giveup(unreadable);
+            //moves: an added file with the same content as a removed one becomes a rename (or a copy once
+            //that one is taken), one with the same name and a similar size gets diffed against it instead.
+            //what's left looks for a similar file anywhere in the original to diff against
+            vector<int64> gsize[2];
+            for (int i = 0; i < 2; i++)
+                for (const string& str : onlyin[i]) gsize[i].push_back(rootdir[i]->find(str, false)->filesize);
+            vector<int> exact(onlyin[1].size(), -1);
+            vector<string> base(onlyin[1].size());
+            vector<int64> basesize(onlyin[1].size());
+            vector<Byte> keep(onlyin[1].size()), renamed(onlyin[0].size()), similar(onlyin[1].size());
+            vector<charvec> nearres(onlyin[1].size());
+            vector<string> nearlogs(onlyin[1].size());
+            if (include[1] && onlyin[0].size() && onlyin[1].size()) {
+                //only files whose size shows up on the other side get hashed
+                unordered_map<int64, vector<int>> bysize;
+                for (size_t r = 0; r < onlyin[0].size(); r++)
+                    if (gsize[0][r] > 0) bysize[gsize[0][r]].push_back(r);
+                vector<Byte> need[2] = { vector<Byte>(onlyin[0].size()), vector<Byte>(onlyin[1].size()) };
+                for (size_t a = 0; a < onlyin[1].size(); a++) {
+                    auto it = bysize.find(gsize[1][a]);
+                    if (gsize[1][a] <= 0 || it == bysize.end()) continue;
+                    need[1][a] = true;
+                    for (int r : it->second) need[0][r] = true;
+                }
+                vector<array<int64, 2>> tohash;
+                for (int i = 0; i < 2; i++)
+                    for (size_t n = 0; n < need[i].size(); n++)
+                        if (need[i][n]) tohash.push_back({ i, (int64)n });
+                {
+                    vector<string> paths(tohash.size());
+                    vector<uint64_t> inodes(tohash.size());
+                    for (size_t k = 0; k < tohash.size(); k++) {
+                        int i = (int)tohash[k][0];
+                        paths[k] = rootstr[i] + onlyin[i][tohash[k][1]];
+                        inodes[k] = rootdir[i]->find(onlyin[i][tohash[k][1]], false)->inode;
+                    }
+                    vector<uint64_t> keys = diskkeys(paths, inodes);
+                    vector<size_t> byplace(tohash.size());
+                    for (size_t k = 0; k < byplace.size(); k++) byplace[k] = k;
+                    storageorder(byplace, keys);
+                    vector<array<int64, 2>> sorted;
+                    for (size_t k : byplace) sorted.push_back(tohash[k]);
+                    tohash.swap(sorted);
+                }
+                vector<Digest> ghash[2] = { vector<Digest>(onlyin[0].size()), vector<Digest>(onlyin[1].size()) };
+                auto ahead = readahead(tohash.size(), [&](int64 k) { prefetchfile(rootstr[tohash[k][0]] + onlyin[tohash[k][0]][tohash[k][1]]); });
+                parallelfor(tohash.size(), [&](int64 k) {
+                    ahead.at(k);
+                    int i = (int)tohash[k][0];
+                    int64 n = tohash[k][1];
+                    string path = rootstr[i] + onlyin[i][n];
+                    MappedFile view(path);
+                    if (view.data) ghash[i][n] = hashbuf(view.data, view.size, HASH_FAST128);
+                    else if (!hashfile(path, gsize[i][n], ghash[i][n], HASH_FAST128)) need[i][n] = false; //can't be matched on what couldn't be read
+                });
+                vector<Byte> taken(onlyin[0].size());
+                for (size_t a = 0; a < onlyin[1].size(); a++) {
+                    if (!need[1][a]) continue;
+                    for (int r : bysize[gsize[1][a]]) {
+                        if (!need[0][r] || ghash[0][r] != ghash[1][a]) continue;
+                        if (exact[a] < 0 || (taken[exact[a]] && !taken[r])) exact[a] = r;
+                    }
+                    if (exact[a] < 0) continue;
+                    keep[a] = taken[exact[a]] || !include[2];
+                    taken[exact[a]] = true;
+                    renamed[exact[a]] |= !keep[a];
+                }
+                unordered_map<string, vector<int>> byname;
+                for (size_t r = 0; r < onlyin[0].size(); r++)
+                    byname[onlyin[0][r].substr(onlyin[0][r].rfind('/') + 1)].push_back(r);
+                for (size_t a = 0; a < onlyin[1].size(); a++) {
+                    auto it = byname.find(onlyin[1][a].substr(onlyin[1][a].rfind('/') + 1));
+                    if (exact[a] >= 0 || gsize[1][a] <= 0 || it == byname.end()) continue;
+                    int near = -1;
+                    for (int r : it->second) { //closest size within 2x
+                        int64 s = gsize[0][r], t = gsize[1][a];
+                        if (s <= 0 || s > t * 2 || t > s * 2) continue;
+                        if (near < 0 || llabs(s - t) < llabs(gsize[0][near] - t)) near = r;
+                    }
+                    if (near < 0) continue;
+                    base[a] = onlyin[0][near];
+                    basesize[a] = gsize[0][near];
+                }
+            }
+            if (include[1]) {
+                vector<size_t> want;
+                vector<int64> wsizes;
+                for (size_t a = 0; a < onlyin[1].size(); a++)
+                    if (exact[a] < 0 && base[a].empty() && gsize[1][a] > 0) {
+                        want.push_back(a);
+                        wsizes.push_back(gsize[1][a]);
+                    }
+                sort(wsizes.begin(), wsizes.end());
+                //only originals within 2x of some added file's size are worth reading
+                vector<size_t> cands;
+                vector<int64> csizes;
+                for (size_t o = 0; want.size() && o < walked[0].size(); o++) {
+                    int64 s = rootdir[0]->find(walked[0][o], false)->filesize;
+                    auto it = lower_bound(wsizes.begin(), wsizes.end(), (s + 1) / 2);
+                    if (s > 0 && it != wsizes.end() && *it <= s * 2) {
+                        cands.push_back(o);
+                        csizes.push_back(s);
+                    }
+                }
+                if (cands.size()) {
+                    vector<Sketch> sk(cands.size() + want.size());
+                    parallelfor(sk.size(), [&](int64 k) {
+                        string path = k < (int64)cands.size() ? rootstr[0] + walked[0][cands[k]] : rootstr[1] + onlyin[1][want[k - cands.size()]];
+                        MappedFile view(path);
+                        if (view.data) sk[k] = sketchbuf(view.data, view.size);
+                        else {
+                            ifstream f(path, ios::binary | ios::in);
+                            charvec v((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+                            sk[k] = sketchbuf(v.data(), v.size());
+                        }
+                    });
+                    SketchIndex index;
+                    for (size_t c = 0; c < cands.size(); c++) index.add(c, sk[c]);
+                    for (size_t w = 0; w < want.size(); w++) {
+                        const Sketch& s = sk[cands.size() + w];
+                        int share, c = index.best(s, MAX(2, s.size() / 4), share);
+                        int64 t = gsize[1][want[w]];
+                        if (c < 0 || csizes[c] > t * 2 || t > csizes[c] * 2) continue;
+                        base[want[w]] = walked[0][cands[c]];
+                        basesize[want[w]] = csizes[c];
+                        similar[want[w]] = true;
+                    }
+                }
+            }
+            vector<size_t> deltas;
+            for (size_t a = 0; a < onlyin[1].size(); a++)
+                if (base[a].size()) deltas.push_back(a);
+            parallelfor(deltas.size(), [&](int64 k) {
+                size_t a = deltas[k];
+                ostringstream log;
+                logto = &log;
+                string fpath[2] = { rootstr[0] + base[a], rootstr[1] + onlyin[1][a] };
+                MappedFile view[2] = { MappedFile(fpath[0]), MappedFile(fpath[1]) };
+                if (view[0].data && view[1].data) {
+                    inmem = true;
+                    nearres[a] = createpatch(view[0].data, view[0].size, view[1].data, view[1].size, false, hashbuf(view[0].data, view[0].size));
+                }
+                else {
+                    Digest c; //no base to diff against, it's stored whole instead
+                    if (hashfile(fpath[0], basesize[a], c)) nearres[a] = createpatch(ifstream(fpath[0], ios::binary | ios::in), ifstream(fpath[1], ios::binary | ios::in), false, c);
+                }
+                nearlogs[a] = log.str();
+                logto = &cout;
+            });
+            //dedup: identical added files share one record, and files with chunks that show up more than once
+            //(in them or in other added files) are stored as a list of chunk records that are each stored once.
+            //hashed before the subtrees are picked, a dir with anything to share isn't one
+            vector<int> firstof(onlyin[1].size());
+            vector<Digest> fhash(onlyin[1].size());
+            vector<vector<array<int64, 2>>> chunks(onlyin[1].size());
+            vector<vector<Digest>> chash(onlyin[1].size());
+            vector<size_t> addorder(onlyin[1].size());
+            {
+                vector<string> paths(onlyin[1].size());
+                vector<uint64_t> inodes(onlyin[1].size());
+                for (size_t a = 0; a < onlyin[1].size(); a++) {
+                    addorder[a] = a;
+                    if (exact[a] >= 0 || !include[1]) continue;
+                    paths[a] = rootstr[1] + onlyin[1][a];
+                    inodes[a] = rootdir[1]->find(onlyin[1][a], false)->inode;
+                }
+                storageorder(addorder, diskkeys(paths, inodes));
+            }
+            auto addahead = readahead(addorder.size(), [&](int64 k) {
+                size_t a = addorder[k];
+                if (exact[a] < 0 && include[1] && (!uringok() || gsize[1][a] > AIO_SMALL)) prefetchfile(rootstr[1] + onlyin[1][a]);
+            });
+            auto wanted = [&](size_t a) { return exact[a] < 0 && include[1]; };
+            loadfiles(addorder.size(), [&](int64 k) {
+                size_t a = addorder[k];
+                return wanted(a) && gsize[1][a] <= AIO_SMALL ? rootstr[1] + onlyin[1][a] : string();
+            }, [&](int64 k) { return gsize[1][addorder[k]]; }, [&](int64 k, charvec* data) {
+                size_t a = addorder[k];
+                if (!wanted(a)) return;
+                string path = rootstr[1] + onlyin[1][a];
+                unique_ptr<MappedFile> view;
+                charvec v;
+                if (data && (int64)data->size() == gsize[1][a]) v.swap(*data);
+                else {
+                    addahead.at(k);
+                    view.reset(new MappedFile(path));
+                }
+                const Byte* p = view ? view->data : v.data();
+                if (!p) {
+                    ifstream f(path, ios::binary | ios::in);
+                    v.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+                    p = v.data();
+                }
+                fhash[a] = hashbuf(p, gsize[1][a], HASH_FAST128);
+                if (gsize[1][a] < DD_MINCHUNK * 2) return;
+                chunkbuf(p, gsize[1][a], DD_MASK, DD_MINCHUNK, DD_MAXCHUNK, [&](int64 start, int64 len) {
+                    chunks[a].push_back({ start, len });
+                    chash[a].push_back(hashbuf(p + start, len, HASH_FAST128));
+                });
+            });
+            vector<Byte> shares(onlyin[1].size());
+            {
+                map<pair<uint64_t, uint64_t>, int> fileuses, chunkall;
+                for (size_t a = 0; a < onlyin[1].size(); a++) {
+                    if (!wanted(a) || gsize[1][a] <= 0) continue; //nothing to gain on empty ones
+                    fileuses[make_pair(fhash[a].lo, fhash[a].hi)]++;
+                    for (const Digest& d : chash[a]) chunkall[make_pair(d.lo, d.hi)]++;
+                }
+                for (size_t a = 0; a < onlyin[1].size(); a++) {
+                    if (!wanted(a) || gsize[1][a] <= 0) continue;
+                    shares[a] = fileuses[make_pair(fhash[a].lo, fhash[a].hi)] > 1;
+                    for (const Digest& d : chash[a]) shares[a] |= chunkall[make_pair(d.lo, d.hi)] > 1;
+                }
+            }
+            //subtrees: a dir that's only on one side is one entry. a removed one goes in one go after everything else,
+            //an added one is packed into one stream as long as nothing in it is a move, worth a delta or shares
+            //content with another added file
+            vector<Byte> insub[2] = { vector<Byte>(onlyin[0].size()), vector<Byte>(onlyin[1].size()) };
+            vector<string> subtrees[2];
+            auto under = [&](int i, const string& dir) { //the range of onlyin[i] inside dir
+                string p = dir + "/";
+                auto from = lower_bound(onlyin[i].begin(), onlyin[i].end(), p);
+                auto to = from;
+                while (to != onlyin[i].end() && !to->compare(0, p.size(), p)) to++;
+                return make_pair(from - onlyin[i].begin(), to - onlyin[i].begin());
+            };
+            for (int i = 0; i < 2; i++) {
+                if (!include[i ? 1 : 2]) continue;
+                for (const string& dir : rootdir[i]->walklist(true)) {
+                    Dir* d = rootdir[i]->find(dir, false);
+                    if (!d->isdir || rootdir[!i]->find(dir, false)) continue;
+                    const string* last = subtrees[i].size() ? &subtrees[i].back() : nullptr;
+                    if (last && !dir.compare(0, last->size() + 1, *last + "/")) continue; //inside one already
+                    auto r = under(i, dir);
+                    bool ok = true;
+                    int64 total = 0;
+                    for (int64 a = r.first; i && ok && a < r.second; a++) {
+                        ok = exact[a] < 0 && nearres[a].empty() && !shares[a];
+                        total += gsize[1][a];
+                    }
+                    if (!ok || total > SUBTREE_MAX) continue; //its subdirs get their own chance
+                    subtrees[i].push_back(dir);
+                    for (int64 a = r.first; a < r.second; a++) insub[i][a] = true;
+                }
+            }
+            for (const string& dir : subtrees[0]) {
+                cout << dir << "/" << endl << " deleted with everything in it" << endl;
+                Dir* dirout = dwritten->find(dir, true);
+                dirout->isdir = false;
+                dirout->moved = ET_RMTREE;
+            }
+            //an added one is varint count, then for every node under it in order varint(pathlen << 1 | isdir) path
+            //[varint size], then the files one after the other
+            for (const string& dir : subtrees[1]) {
+                charvec raw, data;
+                int64 count = 0;
+                for (const string& p : rootdir[1]->walklist(true, rootdir[1]->find(dir, false))) {
+                    Dir* d = rootdir[1]->find(p, false);
+                    string rel = p.substr(dir.size() + 1);
+                    writevarint(raw, (rel.size() << 1) | d->isdir);
+                    raw.insert(raw.end(), rel.begin(), rel.end());
+                    if (!d->isdir) {
+                        ifstream f(rootstr[1] + p, ios::binary | ios::in);
+                        writevarint(raw, d->filesize);
+                        data.resize(data.size() + d->filesize);
+                        if (f) f.read((char*)data.data() + data.size() - d->filesize, d->filesize);
+                        if (!f || f.gcount() != d->filesize) {
+                            cout << p << endl << " unable to read" << endl;
+                            unreadable++;
+                        }
+                    }
+                    count++;
+                }
+                if (unreadable) continue;
+                charvec stream;
+                writevarint(stream, count);
+                stream.insert(stream.end(), raw.begin(), raw.end());
+                stream.insert(stream.end(), data.begin(), data.end());
+                charvec rec = packblock(stream);
+                cout << dir << "/" << endl << " added with everything in it, " << count << " entries, " << stream.size() << " -> " << rec.size() << endl;
+                Dir* dirout = dwritten->find(dir, true);
                 dirout->isdir = false;
-                inb.push_back({(int64)outbuf.size(), (int64)r.size()});
-                bytec = MAX(getbytes(r.size()), bytec);
-                outbuf.insert(outbuf.end(), r.begin(), r.end());
-                r.~vector();
+                dirout->moved = ET_ADDTREE;
+                dirout->filesize = emit(rec);
             }
-            for (const string& str : onlyin[0]) { //deletions
+            if (unreadable) return giveup(unreadable);
+            for (size_t r = 0; r < onlyin[0].size(); r++) { //deletions
+                if (renamed[r] || insub[0][r]) continue; //goes away with the rename or its dir
+                const string& str = onlyin[0][r];
                 cout << str << endl << " deleted" << endl;
                 Dir* dirout = dwritten->find(str, true);
                 dirout->filesize = -1; //-1 to signal deletion
                 dirout->isdir = false;
             }
-            for (const string& str : onlyin[1])   //calc bytesize for additions
-                bytec = MAX(getbytes(rootdir[1]->find(str, false)->filesize), bytec);
-            for (const string& str : onlyin[1]) { //additions
-                cout << str << endl << " added" << endl;
+            map<pair<uint64_t, uint64_t>, int> firstwith;
+            map<pair<uint64_t, uint64_t>, int> chunkuses;
+            for (size_t a = 0; a < onlyin[1].size(); a++) {
+                firstof[a] = a;
+                if (exact[a] >= 0 || insub[1][a] || !include[1]) continue;
+                firstof[a] = firstwith.emplace(make_pair(fhash[a].lo, fhash[a].hi), a).first->second;
+                if (firstof[a] == (int)a)
+                    for (const Digest& d : chash[a]) chunkuses[make_pair(d.lo, d.hi)]++;
+            }
+            vector<Byte> chunked(onlyin[1].size());
+            for (size_t a = 0; a < onlyin[1].size(); a++)
+                for (const Digest& d : chash[a])
+                    if (firstof[a] == (int)a && chunkuses[make_pair(d.lo, d.hi)] > 1) chunked[a] = true;
+            map<pair<uint64_t, uint64_t>, int64> chunkat; //where each stored chunk's record is
+            vector<Dir*> outnode(onlyin[1].size());
+            for (size_t a = 0; a < onlyin[1].size(); a++) { //calc bytesize for additions
+                bytec = MAX(getbytes(gsize[1][a]), bytec);
+            }
+            //a record is [uncompressed size if packed] size data [lzma props], chunk records start with their type
+            auto writerecord = [&](charvec& to, const charvec& r, Byte used, int64 fs, Byte* props) {
+                if (used) writeint(to, fs, bytec);
+                writeint(to, r.size(), bytec);
+                to.insert(to.end(), r.begin(), r.end());
+                if (used == 2) to.insert(to.end(), props, props + 5);
+            };
+            vector<int> solidfiles;
+            for (size_t a = 0; a < onlyin[1].size(); a++) { //additions
+                if (insub[1][a]) continue;
+                const string& str = onlyin[1][a];
                 Dir* dirout = dwritten->find(str, true);
-                dirout->filesize = outbuf.size(); //use loc
+                outnode[a] = dirout;
+                dirout->isdir = false;
+                if (exact[a] >= 0) {
+                    cout << str << endl << (keep[a] ? " copied from " : " moved from ") << onlyin[0][exact[a]] << endl;
+                    dirout->filesize = 0;
+                    dirout->moved = ET_MOVED | (keep[a] ? ET_KEEP : 0);
+                    dirout->from = dwritten->sources.size();
+                    dwritten->sources.push_back(onlyin[0][exact[a]]);
+                    continue;
+                }
+                if (firstof[a] != (int)a) { //filled in once the first one is written
+                    cout << str << endl << " same as " << onlyin[1][firstof[a]] << endl;
+                    continue;
+                }
+                if (solidmb && !chunked[a] && !nearres[a].size()) {
+                    cout << str << endl << " added to a solid block" << endl;
+                    solidfiles.push_back(a);
+                    continue;
+                }
                 string fpath = rootstr[1] + str;
                 ifstream added(fpath, ios::binary | ios::in);
-                int64 fs = rootdir[1]->find(str, false)->filesize;
-                char* buf = new char[fs];
-                added.read(buf, fs);
-                charvec r(buf, buf + fs);
-                char used = 0;
-                Bytef* out = new Bytef[compressBound(fs)];
-                uLongf outsize = compressBound(fs);
-                compress2(out, &outsize, (Bytef*)buf, fs, 9);
-                if (outsize < fs) {
-                    r.~vector();
-                    r = charvec(out, out+outsize);
-                    used = 1;
+                int64 fs = gsize[1][a];
+                charvec buf(fs);
+                added.read((char*)buf.data(), fs);
+                charvec r;
+                Byte used = 0, props[5];
+                //chunked: only the chunks nobody stored yet get a record, the file itself is count(4) + refs(8 each)
+                vector<pair<Digest, charvec>> fresh;
+                int64 cost = 0;
+                if (chunked[a]) {
+                    map<pair<uint64_t, uint64_t>, bool> infile;
+                    for (size_t c = 0; c < chunks[a].size(); c++) {
+                        const Digest& d = chash[a][c];
+                        if (chunkat.count(make_pair(d.lo, d.hi)) || !infile.emplace(make_pair(d.lo, d.hi), true).second) continue;
+                        charvec rec = { 0 };
+                        charvec packed;
+                        rec[0] = packbest(buf.data() + chunks[a][c][0], chunks[a][c][1], packed, props);
+                        writerecord(rec, packed, rec[0], chunks[a][c][1], props);
+                        cost += rec.size();
+                        fresh.push_back({ d, move(rec) });
+                    }
+                    cost += 4 + chunks[a].size() * 8;
                 }
-                delete[] out;
-                out = new Bytef[fs * 2];
-                size_t lzmasize = fs * 2;
-                char* props = new char[5];
-                size_t propssize = 5;
-                int rcode = LzmaCompress(out, &lzmasize, (unsigned char*)buf, fs, (unsigned char*)props, &propssize, 9, 0, -1, -1, -1, -1, -1);
-                if (!rcode && lzmasize < r.size()) {
-                    r.~vector();
-                    r = charvec(out, out + lzmasize);
-                    used = 2;
+                else {
+                    used = packbest(buf.data(), fs, r, props);
+                    cost = r.size() + (used ? bytec : 0) + (used == 2 ? 5 : 0);
                 }
-                delete[] out;
-                delete[] buf;
-                dirout->initialized = 2 + used; //store used thing in here
-                dirout->isdir = false;
-                if (used) writeint(outbuf, fs, bytec);
-                writeint(outbuf, r.size(), bytec);
-                outbuf.insert(outbuf.end(), r.begin(), r.end());
-                r.~vector();
-                if (used == 2) {
-                    charvec propvec(props, props + 5);
-                    outbuf.insert(outbuf.end(), propvec.begin(), propvec.end());
-                    propvec.~vector();
+                buf = charvec();
+                //a diff against its base if that comes out smaller than storing it
+                const charvec& nr = nearres[a];
+                if (nr.size() && (int64)(nr.size() + 2 + base[a].size()) < cost) {
+                    cout << str << endl << nearlogs[a] << (similar[a] ? " delta against " : " moved from ") << base[a] << (similar[a] ? "" : " and edited") << endl;
+                    dirout->moved = ET_DELTA;
+                    dirout->from = dwritten->sources.size();
+                    dwritten->sources.push_back(base[a]);
+                    dirout->filesize = emit(nr); //use loc
+                    dirout->patchlen = nr.size();
+                    continue;
+                }
+                if (chunked[a]) {
+                    for (auto& f : fresh) chunkat[make_pair(f.first.lo, f.first.hi)] = emit(f.second);
+                    cout << str << endl << " added in " << chunks[a].size() << " chunks, " << fresh.size() << " new" << endl;
+                    dirout->added = 1 + 3;
+                    charvec refs;
+                    writeint(refs, chunks[a].size(), 4);
+                    for (const Digest& d : chash[a]) writeint(refs, chunkat[make_pair(d.lo, d.hi)], 8);
+                    dirout->filesize = emit(refs);
+                    continue;
                 }
+                if (solidmb) {
+                    cout << str << endl << " added to a solid block" << endl;
+                    solidfiles.push_back(a);
+                    continue;
+                }
+                cout << str << endl << " added" << endl;
+                dirout->added = 1 + used;
+                charvec rec;
+                writerecord(rec, r, used, fs, props);
+                dirout->filesize = emit(rec);
             }
-            //now we have to write the header
-            shared.~vector();
-            for (int i = 0; i < 2; i++) {
-                walked[i].~vector();
-                onlyin[i].~vector();
+            //solid: the plain additions packed together in blocks of about solidmb, sorted by extension then name so
+            //files of a kind sit next to each other. each of a block's files gets a ref: varint block offset,
+            //varint start, varint size
+            vector<array<string, 3>> keys(onlyin[1].size());
+            for (int a : solidfiles) {
+                const string& p = onlyin[1][a];
+                size_t name = p.rfind('/') + 1, dot = p.rfind('.');
+                keys[a] = { dot != string::npos && dot >= name ? p.substr(dot) : "", p.substr(name), p };
+            }
+            stable_sort(solidfiles.begin(), solidfiles.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+            vector<vector<int>> blocks;
+            int64 fill = 0;
+            for (int a : solidfiles) {
+                if (blocks.empty() || fill >= ((int64)solidmb << 20)) {
+                    blocks.emplace_back();
+                    fill = 0;
+                }
+                blocks.back().push_back(a);
+                fill += gsize[1][a];
             }
-            DirIterator* itr = new DirIterator(dwritten.get());
-            writeint(dirhead, dwritten->children.size(), 2);
-            while (Dir* x = itr->next()) {
-                cout << x->path() << endl;
-                dirhead.push_back((Byte)x->name.size() | (0x80 * !x->isdir));
-                dirhead.insert(dirhead.end(), x->name.begin(), x->name.end());
-                if (!x->isdir) {
-                    char typ = 0;
-                    if (x->initialized > true) typ = 1;
-                    else if (x->filesize < 0)  typ = 2;
-                    if (typ == 1) {
-                        typ |= (((x->initialized & 0b111) - 2) << 4);
+            for (size_t b0 = 0; b0 < blocks.size(); b0 += threadcount()) { //a core's worth of blocks in memory at once
+                size_t n = MIN(threadcount(), blocks.size() - b0);
+                vector<charvec> recs(n);
+                vector<int64> raws(n);
+                vector<Byte> misread(onlyin[1].size());
+                parallelfor(n, [&](int64 i) {
+                    charvec raw;
+                    bool ok = true;
+                    for (int a : blocks[b0 + i]) {
+                        ifstream f(rootstr[1] + onlyin[1][a], ios::binary | ios::in);
+                        raw.resize(raw.size() + gsize[1][a]);
+                        if (f) f.read((char*)raw.data() + raw.size() - gsize[1][a], gsize[1][a]);
+                        misread[a] = !f || f.gcount() != gsize[1][a];
+                        ok &= !misread[a];
                     }
-                    dirhead.push_back(typ);
-                    if (typ != 2) {
-                        writeint(dirhead, x->filesize, getbytes(outbuf.size()));
+                    if (ok) recs[i] = packblock(raw);
+                    raws[i] = raw.size();
+                });
+                for (size_t i = 0; i < n; i++)
+                    for (int a : blocks[b0 + i])
+                        if (misread[a]) {
+                            cout << onlyin[1][a] << endl << " unable to read" << endl;
+                            unreadable++;
+                        }
+                if (unreadable) return giveup(unreadable);
+                for (size_t i = 0; i < n; i++) {
+                    int64 blockat = emit(recs[i]), start = 0;
+                    cout << "solid block " << b0 + i << ": " << blocks[b0 + i].size() << " files, " << raws[i] << " -> " << recs[i].size() << endl;
+                    recs[i] = charvec();
+                    for (int a : blocks[b0 + i]) {
+                        charvec ref;
+                        writevarint(ref, blockat);
+                        writevarint(ref, start);
+                        writevarint(ref, gsize[1][a]);
+                        outnode[a]->added = 1 + 4;
+                        outnode[a]->filesize = emit(ref);
+                        start += gsize[1][a];
                     }
                 }
-                else writeint(dirhead, x->children.size(), 2);
             }
-            ofstream out(argv[4], ios::binary | ios::out);
-            charvec h({ 'X', 'X', 'X', 0x80 });
-            out.write((char*)h.data(), 4);
-            h[0] = getbytes(outbuf.size()) | (bytec << 4);
-            out.write((char*)h.data(), 1);
-            out.write((char*)dirhead.data(), dirhead.size());
-            for (const array<int64, 2> & x : inb) {
-                charvec ref(outbuf.begin(), outbuf.begin() + x[0]);
-                writeint(ref, x[1], bytec);
-                outbuf.erase(outbuf.begin(), outbuf.begin() + x[0]);
-                out.write((char*)ref.data(), ref.size());
-                ref.~vector();
-            }
-            out.write((char*)outbuf.data(), outbuf.size());
+            for (size_t a = 0; a < onlyin[1].size(); a++) {
+                if (exact[a] >= 0 || firstof[a] == (int)a) continue;
+                Dir* same = outnode[firstof[a]];
+                outnode[a]->filesize = same->filesize;
+                outnode[a]->patchlen = same->patchlen;
+                outnode[a]->added = same->added;
+                outnode[a]->moved = same->moved;
+                outnode[a]->from = same->from;
+            }
+            //now we have to write the header
+            vector<string>().swap(shared);
+            for (int i = 0; i < 2; i++) {
+                vector<string>().swap(walked[i]);
+                vector<string>().swap(onlyin[i]);
+            }
+            //trailing header: sizes, the packing used, the compact tree, then the path index, then where the index
+            //and header start. offsets are varints so the low nibble of the sizes is 0
+            DirIterator* itr = new DirIterator(dwritten->root());
+            while (Dir* x = itr->next()) cout << x->path() << endl;
+            charvec tree, packed;
+            Byte props[5];
+            writecheader(tree, dwritten->root());
+            Byte used = packbest(tree.data(), tree.size(), packed, props);
+            dirhead.push_back(bytec << 4);
+            dirhead.push_back(used | (subtrees[0].size() || subtrees[1].size() ? HF_TREES : 0) | (count(replaced.begin(), replaced.end(), 1) ? HF_REPLACED : 0));
+            if (used) {
+                writevarint(dirhead, tree.size());
+                writevarint(dirhead, packed.size());
+            }
+            if (used == 2) dirhead.insert(dirhead.end(), props, props + 5);
+            dirhead.insert(dirhead.end(), packed.begin(), packed.end());
+            int64 headat = emit(dirhead);
+            vector<pair<string, Dir*>> files;
+            itr = new DirIterator(dwritten->root());
+            while (Dir* x = itr->next()) if (!x->isdir) files.push_back({ x->path(), x });
+            sort(files.begin(), files.end());
+            charvec table;
+            writeint(table, files.size(), 8);
+            for (const auto& f : files) {
+                charvec rec;
+                writevarint(rec, f.first.size());
+                rec.insert(rec.end(), f.first.begin(), f.first.end());
+                writeentry(rec, f.second, 0, true);
+                writeint(table, emit(rec), 8);
+            }
+            charvec tail;
+            writeint(tail, emit(table), 8);
+            writeint(tail, headat, 8);
+            out.write((char*)tail.data(), 16);
+            if (dwritten->sources.size()) { //only known now
+                out.seekp(3);
+                out.put(dirflags | pflags | PF_MOVES);
+            }
             out.close();
+            if (!out) {
+                cout << "unable to write " << argv[4] << endl;
+                return 1;
+            }
             return 0;
         }
         else {
@@ -292,24 +1010,17 @@ int main(int argc, char* argv[]) {
             int64 ogfs = f.st_size;
             stat(argv[3], &f);
             int64 edfs = f.st_size;
-            ifstream og(argv[2], ios::binary | ios::in);
-            ifstream ed(argv[3], ios::binary | ios::in);
-            char* ogb = new char[ogfs];
-            og.read(ogb, ogfs);
-            uint c = CRC::Calculate(ogb, ogfs, CRC::CRC_32());
-            delete[] ogb;
-            og.close();
-            if (docompare && ogfs == edfs) {
-                char* edb = new char[ogfs];
-                ed.read(edb, ogfs);
-                uint edc = CRC::Calculate(edb, ogfs, CRC::CRC_32());
-                delete[] edb;
-                if (c == edc) {
-                    cout << "files are the same" << endl;
-                    return 0;
-                }
-            }
-            ed.close();
+            Digest c, d;
+            bool compare = docompare && ogfs == edfs;
+            for (int i = 2; i < 4; i++)
+                if ((i == 2 || compare) && !hashfile(argv[i], i == 2 ? ogfs : edfs, i == 2 ? c : d)) {
+                    cout << "unable to read " << argv[i] << endl;
+                    return 2;
+                }
+            if (compare && c == d) {
+                cout << "files are the same" << endl;
+                return 0;
+            }
             charvec r = createpatch(ifstream(argv[2], ios::binary | ios::in), ifstream(argv[3], ios::binary | ios::in), true, c);
             if (!r.size()) {
                 cout << "files are the same" << endl;
@@ -317,7 +1028,7 @@ int main(int argc, char* argv[]) {
             }
             ofstream out(argv[4], ios::binary | ios::out);
             out.write((char*)r.data(), r.size());
-            r.~vector();
+            charvec().swap(r);
             out.close();
             return 0;
         }
@@ -327,110 +1038,436 @@ int main(int argc, char* argv[]) {
         if (isfolder) {
             namespace fs = std::filesystem;
             charvec h({ 'X', 'X', 'X', 0x80 });
-            ifstream pt(argv[3], ios::binary | ios::in);
-            pt.seekg(0, 2);
-            int64 ptp = 0, ptl = pt.tellg();
-            pt.seekg(0);
-            char* ptb = new char[ptl];
-            pt.read(ptb, ptl);
-            charvec ptvec(ptb, ptb + ptl);
-            delete[] ptb;
-            pt.close();
-            if (readvec(ptvec, 4, ptp) != h) {
+            //mapped, everything below reads its part of the patch straight out of the mapping
+            MappedFile pt(argv[3]);
+            if (!pt.data) {
+                cout << "unable to open patch " << argv[3] << endl;
+                return 3;
+            }
+            ByteView ptvec(pt.data, pt.size);
+            int64 ptp = 0, ptl = pt.size;
+            charvec magic = readvec(ptvec, 4, ptp);
+            if (magic.size() < 4 || !equal(h.begin(), h.begin() + 3, magic.begin()) || !(magic[3] & 0x80)) {
                 cout << "invalid header" << endl;
                 return 3;
             }
+            pflags = magic[3] & 0x7F;
+            if (pflags & PF_HASH) hashalgo = readintvec(ptvec, 1, ptp);
+            if ((pflags & ~PF_KNOWN) || hashalgo >= HASH_COUNT) {
+                cout << "patch uses features this version doesn't support" << endl;
+                return 3;
+            }
+            //a trailing header says where it is in the last 8 bytes, older patches have it right here
+            int64 addend = ptp, table = -1;
+            if (pflags & PF_INDEX) {
+                int64 end = ptl - 8;
+                ptp = addend + readintvec(ptvec, 8, end);
+                end = ptl - 16;
+                if (pflags & PF_PATHS) table = addend + readintvec(ptvec, 8, end);
+            }
             //LOL i cant be assed to type "unsigned char" since byte is ambigous here so use zlib's Byte
             Byte bc = readintvec(ptvec, 1, ptp);
             Byte ac = (bc & 0xF0) >> 4;
             bc &= 0xF;
-            Dir* rootdir = new Dir();
-            readdheader(ptvec, ptp, bc, rootdir);
-            int64 addend = ptp;
+            unique_ptr<DirTree> rootdir = unique_ptr<DirTree>(new DirTree());
+            auto wanted = [&](const string& path) {
+                for (const string& g : only) if (globmatch(g.c_str(), path.c_str())) return true;
+                return only.empty();
+            };
+            //a subtree entry is wanted when a glob takes all of it
+            auto wantedentry = [&](Dir* x) {
+                bool tree = x->moved == ET_RMTREE || x->moved == ET_ADDTREE;
+                return wanted(x->path()) || (tree && wanted(x->path() + "/"));
+            };
+            Byte hflags = (pflags & PF_COMPACT) ? readintvec(ptvec, 1, ptp) : 0;
+            if (hflags & 0xF0 & ~HF_KNOWN) {
+                cout << "patch uses features this version doesn't support" << endl;
+                return 3;
+            }
+            if (only.size() && table >= 0) {
+                //binary search to where the glob's fixed start would be, the matches are all right after it
+                int64 at = table, count = readintvec(ptvec, 8, at), pos;
+                auto lowerbound = [&](const string& key) {
+                    int64 lo = 0, hi = count;
+                    while (lo < hi) {
+                        int64 mid = (lo + hi) / 2;
+                        if (indexpath(ptvec, addend, table, mid, pos, bc) < key) lo = mid + 1;
+                        else hi = mid;
+                    }
+                    return lo;
+                };
+                auto take = [&](const string& path) {
+                    if (rootdir->find(path, false)) return;
+                    Dir* d = rootdir->find(path, true);
+                    d->isdir = false;
+                    readentry(ptvec, pos, bc, d, true);
+                };
+                auto istree = [&] { return pos < ptl && (ptvec.data[pos] == ET_RMTREE || ptvec.data[pos] == ET_ADDTREE); };
+                for (const string& g : only) {
+                    string prefix = g.substr(0, g.find_first_of("*?"));
+                    //subtree entries sit at their dir's path, before everything under it
+                    for (size_t sl = prefix.find('/'); sl != string::npos; sl = prefix.find('/', sl + 1)) {
+                        string dir = prefix.substr(0, sl);
+                        int64 i = lowerbound(dir);
+                        if (i < count && indexpath(ptvec, addend, table, i, pos, bc) == dir && istree() && globmatch(g.c_str(), (dir + "/").c_str())) take(dir);
+                    }
+                    for (int64 i = lowerbound(prefix); i < count; i++) {
+                        string path = indexpath(ptvec, addend, table, i, pos, bc);
+                        if (path.compare(0, prefix.size(), prefix)) break;
+                        if (globmatch(g.c_str(), path.c_str()) || (istree() && globmatch(g.c_str(), (path + "/").c_str()))) take(path);
+                    }
+                }
+            }
+            else if (pflags & PF_COMPACT) {
+                Byte used = hflags & 0xF;
+                if (used) {
+                    int64 raw = readvarint(ptvec, ptp), size = readvarint(ptvec, ptp);
+                    charvec props = readvec(ptvec, used == 2 ? 5 : 0, ptp);
+                    charvec tree(raw);
+                    int64 tp = 0;
+                    if (ptp + size > ptl || !unpackbest(ptvec.data + ptp, size, used, props.data(), tree.data(), raw)) {
+                        cout << "header is corrupt" << endl;
+                        return 3;
+                    }
+                    readcheader(tree, tp, rootdir->root());
+                }
+                else readcheader(ptvec, ptp, rootdir->root());
+            }
+            else readdheader(ptvec, ptp, bc, rootdir->root(), pflags & PF_INDEX);
+            if (!(pflags & PF_INDEX)) addend = ptp;
             int fails = 0;
-            DirIterator* iter = new DirIterator(rootdir);
-            while (Dir* x = iter->next()) {
-                if (x->isdir) continue;
-                string wholepdir = argv[2];
-                wholepdir += "/" + x->parent->path();
-                string wholedir = wholepdir + "/" + x->name;
-                if (x->filesize == -1 && include[2]) {
-                    if (!fs::remove(wholedir)) {
-                        cout << x->path() << " already did not exist" << endl;
-                        fails++;
-                    }
-                    else cout << "removed " << x->path() << endl;
-                }
-                else if (x->initialized > 1 && include[1]) {
-                    if (fs::exists(wholedir)) cout << x->path() << " exists, will be overwritten" << endl;
-                    Byte typ = x->initialized - 2;
-                    ptp = x->filesize + addend;
-                    charvec dat;
-                    int64 uncmp = readintvec(ptvec, ac, ptp);
-                    if (!typ) {
-                        dat = readvec(ptvec, uncmp, ptp);
+            vector<Dir*> entries;
+            DirIterator* iter = new DirIterator(rootdir->root());
+            while (Dir* x = iter->next()) if (!x->isdir && wantedentry(x)) entries.push_back(x);
+            //files are independent so they all go on the pool. twice as many workers as cores so some can
+            //sit on disk while others work, but only a core's worth of them decompress/patch at once.
+            //whatever reads another original file (copies, deltas) runs before anything is changed in place,
+            //then the renames, and removals go last
+            vector<string> logs(entries.size());
+            vector<Byte> failed(entries.size());
+            vector<int64> phases[4];
+            for (size_t k = 0; k < entries.size(); k++) {
+                Dir* x = entries[k];
+                int p = 1;
+                if (x->moved == (ET_MOVED | ET_KEEP) || x->moved == ET_DELTA) p = 0;
+                else if (x->moved == ET_MOVED) p = 2;
+                else if (x->filesize == -1) p = 3;
+                phases[p].push_back(k);
+            }
+            //solid blocks are unpacked once by whichever file needs them first and dropped after their last file
+            struct Solid {
+                mutex m;
+                bool done = false;
+                charvec data;
+                int64 left = 0;
+            };
+            map<int64, Solid> solid;
+            for (Dir* x : entries)
+                if (x->added == 1 + 4) {
+                    int64 at = x->filesize + addend;
+                    solid[readvarint(ptvec, at)].left++;
+                }
+            string root = argv[2];
+            Gate cpu(threadcount());
+            FileWriter writer; //each phase's files are all written before the next one starts
+            Stager stage;
+            //patches og into out. og and out are the same file unless it moved
+            auto patchto = [&](Dir* x, const string& og, const string& out, int64 k) {
+                ostream& log = *logto;
+                int64 ptp = x->filesize + addend;
+                int64 rl = x->patchlen >= 0 ? x->patchlen : readintvec(ptvec, ac, ptp);
+                int code;
+                charvec result;
+                {
+                    //the file's patch is used where it sits in the patch buffer, the original is mapped if it can be
+                    GateLock busy(cpu);
+                    MappedFile view(og);
+                    if (view.data) {
+                        inmem = true;
+                        result = applypatch(view.data, view.size, (Byte*)ptvec.data + ptp, rl, false, code);
                     }
                     else {
-                        dat = readvec(ptvec, readintvec(ptvec, ac, ptp), ptp);
-                        Bytef* out = new Bytef[uncmp];
-                        if (typ == 1) {
-                            uLongf ucmp = uncmp;
-                            uncompress(out, &ucmp, (Bytef*)dat.data(), dat.size());
-                            dat.~vector();
+                        ifstream ogfile(og, ios::binary | ios::in);
+                        charvec ogvec((istreambuf_iterator<char>(ogfile)), istreambuf_iterator<char>());
+                        inmem = true;
+                        result = applypatch((Byte*)ogvec.data(), ogvec.size(), (Byte*)ptvec.data + ptp, rl, false, code);
+                    }
+                }
+                if (code) {
+                    log << "patch for " << x->path() << " was unsuccessful, skipping" << endl;
+                    failed[k] = 1;
+                    return;
+                }
+                fs::create_directories(fs::path(out).parent_path());
+                writer.put(stage.to(out, k), move(result), k);
+                log << "applied patch to " << x->path() << endl;
+            };
+            auto applyentry = [&](int64 k) {
+                Dir* x = entries[k];
+                ostringstream log;
+                logto = &log;
+                string wholepdir = root;
+                wholepdir += "/" + x->parent->path();
+                string wholedir = wholepdir + "/" + x->name();
+                string src = x->from >= 0 ? root + "/" + rootdir->sources[x->from] : string();
+                int64 ptp;
+                if ((x->moved & 0xF) == ET_MOVED) {
+                    bool copy = (x->moved & ET_KEEP) || !include[2];
+                    error_code ec;
+                    if (include[1]) {
+                        fs::create_directories(wholepdir, ec);
+                        if (copy) fs::copy_file(src, stage.to(wholedir, k), fs::copy_options::overwrite_existing, ec);
+                        else fs::rename(src, wholedir, ec);
+                        if (ec) {
+                            log << x->path() << " could not be moved from " << rootdir->sources[x->from] << ", will be skipped" << endl;
+                            failed[k] = 1;
+                        }
+                        else log << x->path() << (copy ? " copied from " : " moved from ") << rootdir->sources[x->from] << endl;
+                    }
+                    else if (!copy) { //the removal half of a rename still counts
+                        if (!fs::remove(src, ec)) log << rootdir->sources[x->from] << " already did not exist" << endl;
+                        else log << "removed " << rootdir->sources[x->from] << endl;
+                    }
+                }
+                else if (x->moved == ET_DELTA) {
+                    if (include[1] && !fs::exists(src)) {
+                        log << x->path() << " is based on " << rootdir->sources[x->from] << " which does not exist, will be skipped" << endl;
+                        failed[k] = 1;
+                    }
+                    else if (include[1]) patchto(x, src, wholedir, k);
+                }
+                else if (x->moved == ET_RMTREE) {
+                    error_code ec;
+                    if (include[2] && fs::remove_all(wholedir, ec) <= 0) {
+                        log << x->path() << "/ already did not exist" << endl;
+                        failed[k] = 1;
+                    }
+                    else if (include[2]) log << "removed " << x->path() << "/" << endl;
+                }
+                else if (x->moved == ET_REPLACED) {
+                    if (include[0] && !fs::exists(wholedir)) {
+                        log << x->path() << " does not exist, will be skipped" << endl;
+                        failed[k] = 1;
+                    }
+                    else if (include[0]) {
+                        charvec raw;
+                        bool ok;
+                        {
+                            GateLock busy(cpu);
+                            ok = unpackblock(ptvec, x->filesize + addend, raw);
+                        }
+                        if (!ok) {
+                            log << "replacement for " << x->path() << " is corrupt in the patch" << endl;
+                            failed[k] = 1;
                         }
                         else {
-                            size_t ucmp = uncmp;
-                            charvec props = readvec(ptvec, 5, ptp);
-                            size_t size = dat.size();
-                            LzmaUncompress(out, &ucmp, (Byte*)dat.data(), &size, (Byte*)props.data(), 5);
-                            dat.~vector();
+                            writer.put(stage.to(wholedir, k), move(raw), k);
+                            log << "replaced " << x->path() << endl;
                         }
-                        dat = charvec(out, out + uncmp);
                     }
-                    ofstream out(wholedir + "/" + x->name, ios::binary | ios::out);
-                    out.write((char*)dat.data(), uncmp);
-                    dat.~vector();
-                    out.close();
-                    cout << x->path() << " added";
+                }
+                else if (x->moved == ET_ADDTREE) {
+                    charvec raw;
+                    bool ok = true;
+                    if (include[1]) {
+                        GateLock busy(cpu);
+                        ok = unpackblock(ptvec, x->filesize + addend, raw);
+                    }
+                    //names and sizes first, then the files back to back
+                    int64 rp = 0, count = ok ? readvarint(raw, rp) : 0;
+                    vector<pair<string, int64>> files;
+                    if (include[1]) fs::create_directories(wholedir);
+                    for (int64 i = 0; include[1] && i < count; i++) {
+                        int64 head = readvarint(raw, rp);
+                        charvec name = readvec(raw, head >> 1, rp);
+                        string p = wholedir + "/" + string(name.begin(), name.end());
+                        if (head & 1) fs::create_directories(p);
+                        else files.push_back({ p, (int64)readvarint(raw, rp) });
+                    }
+                    for (const auto& f : files) {
+                        ok &= rp + f.second <= (int64)raw.size();
+                        if (!ok) break;
+                        writer.put(stage.to(f.first, k), charvec(raw.begin() + rp, raw.begin() + rp + f.second), k);
+                        rp += f.second;
+                    }
+                    if (!ok) {
+                        log << x->path() << "/ is corrupt in the patch" << endl;
+                        failed[k] = 1;
+                    }
+                    else if (include[1]) log << "added " << x->path() << "/ with " << files.size() << " files" << endl;
+                }
+                else if (x->filesize == -1) {
+                    if (include[2] && !fs::remove(wholedir)) {
+                        log << x->path() << " already did not exist" << endl;
+                        failed[k] = 1;
+                    }
+                    else if (include[2]) log << "removed " << x->path() << endl;
+                }
+                else if (x->added) {
+                    if (include[1]) {
+                        if (fs::exists(wholedir)) log << x->path() << " exists, will be overwritten" << endl;
+                        fs::create_directories(wholepdir);
+                        //small files are put together here and go to the writer, past AIO_SMALL they're streamed out
+                        charvec buf;
+                        ofstream out;
+                        bool streamed = false;
+                        auto write = [&](const Byte* p, int64 n) {
+                            if (!streamed && (int64)buf.size() + n <= AIO_SMALL) {
+                                buf.insert(buf.end(), p, p + n);
+                                return;
+                            }
+                            if (!streamed) {
+                                streamed = true;
+                                out.open(stage.to(wholedir, k), ios::binary | ios::out);
+                                if (out) out.write((char*)buf.data(), buf.size());
+                                buf = charvec();
+                            }
+                            if (out) out.write((char*)p, n); //once it fails the rest is dropped, it's reported below
+                        };
+                        //one stored record, chunked files are a list of offsets of chunk records that lead with their type.
+                        //stored ones are written from the patch as is, packed ones are unpacked from it
+                        auto unpack = [&](int64& at, Byte typ) {
+                            int64 uncmp = readintvec(ptvec, ac, at);
+                            if (!typ) {
+                                write(ptvec.data + at, MAX(MIN(uncmp, ptvec.size - at), 0));
+                                at += uncmp;
+                                return;
+                            }
+                            int64 size = readintvec(ptvec, ac, at);
+                            const Byte* src = ptvec.data + at;
+                            size = MAX(MIN(size, ptvec.size - at), 0);
+                            at += size;
+                            charvec props = readvec(ptvec, typ == 2 ? 5 : 0, at);
+                            charvec dat(uncmp);
+                            {
+                                GateLock busy(cpu);
+                                unpackbest(src, size, typ, props.data(), dat.data(), uncmp);
+                            }
+                            write(dat.data(), uncmp);
+                        };
+                        Byte typ = x->added - 1;
+                        ptp = x->filesize + addend;
+                        if (typ == 4) {
+                            int64 at = readvarint(ptvec, ptp), start = readvarint(ptvec, ptp), size = readvarint(ptvec, ptp);
+                            Solid& b = solid.find(at)->second;
+                            {
+                                lock_guard<mutex> l(b.m);
+                                if (!b.done) {
+                                    GateLock busy(cpu);
+                                    if (!unpackblock(ptvec, at + addend, b.data)) b.data.clear();
+                                    b.done = true;
+                                }
+                            }
+                            if (start + size <= (int64)b.data.size()) write(b.data.data() + start, size);
+                            else {
+                                log << "solid block for " << x->path() << " is corrupt" << endl;
+                                failed[k] = 1;
+                            }
+                            lock_guard<mutex> l(b.m);
+                            if (!--b.left) b.data = charvec();
+                        }
+                        else if (typ == 3) {
+                            int64 count = readintvec(ptvec, 4, ptp);
+                            for (int64 c = 0; c < count; c++) {
+                                int64 cptp = readintvec(ptvec, 8, ptp) + addend;
+                                Byte ctyp = readintvec(ptvec, 1, cptp);
+                                unpack(cptp, ctyp);
+                            }
+                        }
+                        else unpack(ptp, typ);
+                        if (streamed) out.close();
+                        else writer.put(stage.to(wholedir, k), move(buf), k);
+                        if (streamed && !out) {
+                            log << "unable to write " << x->path() << endl;
+                            failed[k] = 1;
+                        }
+                        else log << x->path() << " added" << endl;
+                    }
                 }
                 else if (include[0]) {
                     if (!fs::exists(wholedir)) {
-                        cout << x->path() << " does not exist, will be skipped" << endl;
-                        fails++;
-                        continue;
+                        log << x->path() << " does not exist, will be skipped" << endl;
+                        failed[k] = 1;
                     }
-                    srand(time(nullptr));
-                    int r = rand();
-                    string fpath = "tmp" + to_string(r);
-                    ofstream pt(fpath, ios::binary | ios::out);
-                    ptp = x->filesize + addend;
-                    int64 rl = readintvec(ptvec, ac, ptp);
-                    charvec snippet(ptvec.begin() + ptp, ptvec.begin() + ptp + rl);
-                    pt.write((char*)snippet.data(), snippet.size());
-                    snippet.~vector();
-                    pt.close();
-                    int code;
-                    charvec result = applypatch(ifstream(wholedir, ios::binary | ios::in), ifstream(fpath, ios::binary | ios::in), false, code);
-                    fs::remove(fpath);
-                    if (code) {
-                        cout << "patch for " << x->path() << " was unsuccessful, skipping" << endl;
-                        result.~vector();
-                        fails++;
-                        continue;
+                    else patchto(x, wholedir, wholedir, k);
+                }
+                logs[k] = log.str();
+                logto = &cout;
+            };
+            //each phase goes through what only reads the patch in patch order, then what reads an original in
+            //the order the originals sit on disk, with the next few asked for ahead of the workers
+            vector<string> reads(entries.size());
+            for (size_t k = 0; k < entries.size(); k++) {
+                Dir* x = entries[k];
+                if (include[1] && (x->moved == (ET_MOVED | ET_KEEP) || x->moved == ET_DELTA)) reads[k] = root + "/" + rootdir->sources[x->from];
+                else if (include[0] && !x->moved && x->filesize >= 0 && !x->added) reads[k] = root + "/" + x->path();
+            }
+            vector<uint64_t> keys = diskkeys(reads);
+            for (size_t k = 0; k < entries.size(); k++)
+                if (reads[k].empty()) keys[k] = MAX(entries[k]->filesize, 0);
+            for (int p = 0; p < 4; p++) {
+                //staged files only take the place of the real ones once every one of them is on disk, and
+                //nothing is moved or removed before they have
+                if (p == 2 && staging) {
+                    for (int64 k : stage.commit(failed)) {
+                        logs[k] += "unable to move " + entries[k]->path() + " into place, left as it was\n";
+                        failed[k] = 1;
+                    }
+                    if (!stage.durable) {
+                        for (int q = 2; q < 4; q++)
+                            for (int64 k : phases[q]) {
+                                logs[k] += entries[k]->path() + " left as it was, the staged files could not be synced\n";
+                                failed[k] = 1;
+                            }
+                        break;
                     }
-                    pt = ofstream(wholedir, ios::binary | ios::in);
-                    pt.write((char*)result.data(), result.size());
-                    pt.close();
-                    cout << "applied patch to " << x->path() << endl;
-                    result.~vector();
+                }
+                stable_sort(phases[p].begin(), phases[p].end(), [&](int64 a, int64 b) {
+                    return make_pair(reads[a].size() > 0, keys[a]) < make_pair(reads[b].size() > 0, keys[b]);
+                });
+                auto ahead = readahead(phases[p].size(), [&](int64 i) {
+                    if (reads[phases[p][i]].size()) prefetchfile(reads[phases[p][i]]);
+                });
+                parallelfor(phases[p].size(), [&](int64 i) {
+                    ahead.at(i);
+                    applyentry(phases[p][i]);
+                }, threadcount() * 2);
+                for (int64 k : writer.wait()) {
+                    if (!failed[k]) logs[k] += "unable to write " + entries[k]->path() + "\n";
+                    failed[k] = 1;
                 }
             }
+            if (staging && stage.durable) { //the renames and removals are made durable too
+                set<string> dirs;
+                for (int q = 2; q < 4; q++)
+                    for (int64 k : phases[q]) {
+                        Dir* x = entries[k];
+                        dirs.insert(root + "/" + x->parent->path());
+                        if (x->from >= 0) dirs.insert(fs::path(root + "/" + rootdir->sources[x->from]).parent_path().string());
+                    }
+                vector<string> left; //what a removal took with it has nothing left to sync
+                for (const string& d : dirs)
+                    if (fs::exists(d)) left.push_back(d);
+                stage.synced &= syncpaths(left, true);
+            }
+            for (size_t k = 0; k < entries.size(); k++) {
+                cout << logs[k];
+                fails += failed[k];
+            }
+            int64 moved = 0;
+            for (const auto& f : stage.files) moved += !failed[f.second];
+            if (staging) cout << "committed " << moved << " staged files" << endl;
+            if (!stage.synced) {
+                cout << "unable to sync the folders the staged files were moved into" << endl;
+                fails++;
+            }
             cout << "patching finished with " << fails << " failures/skips";
             return fails;
         }
         else {
             int code;
             charvec result = applypatch(ifstream(argv[2], ios::binary | ios::in), ifstream(argv[3], ios::binary | ios::in), true, code);
+            if (code) return code;
             ofstream out(argv[4], ios::binary | ios::out);
             out.write((char*)result.data(), result.size());
             out.close();
@@ -439,12 +1476,85 @@ int main(int argc, char* argv[]) {
     }
 }
 
-charvec createpatch(std::ifstream ogfile, std::ifstream edfile, bool header, uint crcv) {
-    charvec outbuf;
-    std::vector<std::vector<int64>> inbuf; 
+//whichever of raw, zlib and lzma comes out smallest, returns which (0/1/2). props only get set for lzma
+byte packbest(const byte* data, int64 size, charvec& out, byte* props) {
+    out = charvec(data, data + size);
+    byte used = 0;
+    uLongf zsize = compressBound(size);
+    charvec z(zsize);
+    if (compress2(z.data(), &zsize, data, size, 9) == Z_OK && (int64)zsize < size) {
+        z.resize(zsize);
+        out.swap(z);
+        used = 1;
+    }
+    size_t lzmasize = size * 2, propssize = 5;
+    charvec l(lzmasize);
+    if (size && !LzmaCompress(l.data(), &lzmasize, data, size, props, &propssize, 9, 0, -1, -1, -1, -1, -1) && lzmasize < out.size()) {
+        l.resize(lzmasize);
+        out.swap(l);
+        used = 2;
+    }
+    return used;
+}
+
+//undoes packbest, false if it didn't come out at outsize
+bool unpackbest(const byte* data, int64 size, byte used, const byte* props, byte* out, int64 outsize) {
+    if (!used) {
+        if (size != outsize) return false;
+        memcpy(out, data, size);
+        return true;
+    }
+    if (used == 1) {
+        uLongf ulen = outsize;
+        return uncompress(out, &ulen, data, size) == Z_OK && (int64)ulen == outsize;
+    }
+    size_t ulen = outsize, srclen = size;
+    return !LzmaUncompress(out, &ulen, data, &srclen, props, 5) && (int64)ulen == outsize;
+}
+
+//a packbest'd block that says how it's packed: type(1) varint size, varint packed size [lzma props] data
+charvec packblock(const charvec& raw) {
+    charvec packed, rec;
+    byte props[5];
+    byte used = packbest(raw.data(), raw.size(), packed, props);
+    rec.push_back(used);
+    writevarint(rec, raw.size());
+    writevarint(rec, packed.size());
+    if (used == 2) rec.insert(rec.end(), props, props + 5);
+    rec.insert(rec.end(), packed.begin(), packed.end());
+    return rec;
+}
+bool unpackblock(ByteView from, int64 at, charvec& raw) {
+    byte used = readintvec(from, 1, at);
+    int64 size = readvarint(from, at), packed = readvarint(from, at);
+    charvec props = readvec(from, used == 2 ? 5 : 0, at);
+    raw.resize(size);
+    return used <= 2 && at + packed <= from.size && unpackbest(from.data + at, packed, used, props.data(), raw.data(), size);
+}
+
+//checksum of part of a file, leaves the read position where it was
+Digest rangehash(byte* mem, int64 start, int64 size, int64 max, int64& pos) {
+    if (inmem) return hashbuf(mem + start, size);
+    Hasher h;
+    int64 was = pos;
+    seek(mem, start, 0, max, pos);
+    while (size > 0) {
+        charvec piece = read(mem, (int)MIN(size, CRCCHUNK), pos, max);
+        if (!piece.size()) break;
+        h.update(piece.data(), piece.size());
+        size -= piece.size();
+    }
+    seek(mem, was, 0, max, pos);
+    return h.digest();
+}
+inline Digest blockhash(byte* og, int64 b, byte shift, int64 ogmax, int64& ogpos) {
+    int64 start = b << shift;
+    return rangehash(og, start, MIN((int64)1 << shift, ogmax - start), ogmax, ogpos);
+}
+
+charvec createpatch(std::ifstream ogfile, std::ifstream edfile, bool header, Digest crcv) {
     byte *og, *ed;
-    int64 ogpos = 0, edpos = 0, ogmax = 0, edmax = 0;
-    short count = 0;
+    int64 ogmax = 0, edmax = 0;
     ogfile.seekg(0, 2);
     edfile.seekg(0, 2);
     ogmax = ogfile.tellg();
@@ -463,8 +1573,35 @@ charvec createpatch(std::ifstream ogfile, std::ifstream edfile, bool header, uin
         og = (byte*)&ogfile;
         ed = (byte*)&edfile;
     }
-    uint32_t crcval = crcv;
+    inmem = memory;
+    charvec r = createpatch(og, ogmax, ed, edmax, header, crcv);
+    if (memory) {
+        delete[] og;
+        delete[] ed;
+    }
+    return r;
+}
+
+//og and ed are buffers or ifstream*s depending on inmem
+charvec createpatch(byte* og, int64 ogmax, byte* ed, int64 edmax, bool header, Digest crcv) {
+    charvec outbuf;
+    std::vector<std::vector<int64>> inbuf; 
+    int64 ogpos = 0, edpos = 0;
+    short count = 0;
+    Digest crcval = crcv;
+    overbudget = false;
+    bytecount[1] = bytecount[2] = 0;
     bytecount[0] = getbytes(ogmax);
+    Digest target = (pflags & PF_TARGET) ? rangehash(ed, 0, edmax, edmax, edpos) : Digest();
+    std::vector<Digest> blocks;
+    if (pflags & PF_BLOCKS) {
+        blocks.resize((ogmax + ((int64)1 << blockshift) - 1) >> blockshift);
+        if (inmem) parallelfor(blocks.size(), [&](int64 b) {
+            int64 start = b << blockshift;
+            blocks[b] = hashbuf(og + start, MIN((int64)1 << blockshift, ogmax - start));
+        });
+        else for (uint b = 0; b < blocks.size(); b++) blocks[b] = blockhash(og, b, blockshift, ogmax, ogpos);
+    }
     auto publish = [&](charvec& data, int len, bool add, int loc) {
         int bytes = getbytes(len);
         if (len >> (bytes * 8 - 1)) bytes++;
@@ -480,7 +1617,6 @@ charvec createpatch(std::ifstream ogfile, std::ifstream edfile, bool header, uin
             uLongf outsize = compressBound(cmpsize);
             compress2(out, &outsize, data.data(), cmpsize, 9);
             if (outsize < cmpsize) {
-                written.~vector();
                 written = charvec(out, out + outsize);
                 used = 1;
             }
@@ -491,37 +1627,41 @@ charvec createpatch(std::ifstream ogfile, std::ifstream edfile, bool header, uin
             size_t propssize = 5; 
             int rcode = LzmaCompress(out, &lzmasize, data.data(), cmpsize, props, &propssize, 9, 0, -1, -1, -1, -1, -1);
             if (!rcode && lzmasize < cmpsize) {
-                written.~vector();
                 written = charvec(out, out + lzmasize);
                 used = 2;
             }
             delete[] out;
-            data.~vector();
+            charvec().swap(data);
             writeint(outbuf, used, 1);
             if (used) inbuf.push_back({cmpsize, (int64)outbuf.size(), 0, 2});
             inbuf.push_back({(int64)written.size(), (int64)outbuf.size(), 0, 2});
+            if (pflags & PF_BLOCKS) writedigest(outbuf, hashbuf(written.data(), written.size()));
             outbuf.insert(outbuf.end(), written.begin(), written.end());
-            written.~vector();
+            charvec().swap(written);
             if (used == 2) {
                 charvec propvec(props, props + 5);
                 outbuf.insert(outbuf.end(), propvec.begin(), propvec.end());
-                propvec.~vector();
+                charvec().swap(propvec);
             }
             delete[] props;
         }
-        data.~vector();
+        charvec().swap(data);
         using namespace std;
-        cout << "PUB #" << ++count << " AT " << hex << loc << " OGLEN " << hex << len << " NEWLEN " << hex << cmpsize << (add ? " REPLACEMENT" : " DELETION") << endl;
+        *logto << "PUB #" << ++count << " AT " << hex << loc << " OGLEN " << hex << len << " NEWLEN " << hex << cmpsize << (add ? " REPLACEMENT" : " DELETION") << endl;
     };
     while (read(ed, 1, edpos, edmax).size()) {
+        if (patchbudget >= 0 && (int64)outbuf.size() > patchbudget) {
+            overbudget = true;
+            return charvec();
+        }
         seek(ed, -1, 1, edmax, edpos);
         charvec readog = read(og, chsize, ogpos, ogmax);
         charvec readed = read(ed, chsize, edpos, edmax);
         if (readog == readed) continue;
         seek(og, -len(readog), 1, ogmax, ogpos);
         seek(ed, -len(readed), 1, edmax, edpos);
-        readed.~vector();
-        readog.~vector();
+        charvec().swap(readed);
+        charvec().swap(readog);
         while (true) {
             readog = read(og, 1, ogpos, ogmax);
             readed = read(ed, 1, edpos, edmax);
@@ -529,11 +1669,11 @@ charvec createpatch(std::ifstream ogfile, std::ifstream edfile, bool header, uin
         }
         seek(og, -len(readog), 1, ogmax, ogpos);
         seek(ed, -len(readed), 1, edmax, edpos);
-        readed.~vector();
-        readog.~vector();
+        charvec().swap(readed);
+        charvec().swap(readog);
         int64 loc = ogpos, found;
         using namespace std;
-        cout << "FOUND OG " << hex << loc << " ED " << hex << edpos << endl;
+        *logto << "FOUND OG " << hex << loc << " ED " << hex << edpos << endl;
         charvec dat;
         bool first = true;
         charvec full = read(og, ogmax, ogpos, ogmax);
@@ -552,7 +1692,7 @@ charvec createpatch(std::ifstream ogfile, std::ifstream edfile, bool header, uin
                 seek(ed, -len(cmp), 1, edmax, edpos);
                 readed = read(ed, edmax, edpos, edmax);
                 dat.insert(dat.end(), readed.begin(), readed.end());
-                readed.~vector();
+                charvec().swap(readed);
                 first = false;
                 break;
             }
@@ -564,14 +1704,14 @@ charvec createpatch(std::ifstream ogfile, std::ifstream edfile, bool header, uin
                 for (int i = 0; i < chsize - 1; i++) {
                     readed = read(ed, 1, edpos, edmax);
                     dat.push_back(readed[0]);
-                    readed.~vector();
+                    charvec().swap(readed);
                     charvec dcmp = read(ed, lensize, edpos, edmax);
                     auto itd = search(full.begin(), it, dcmp.begin(), dcmp.end());
                     seek(ed, -lensize, 1, edmax, edpos);
                     if (itd != it) {
                         found = (itd - full.begin()) + loc;
                         cmp = dcmp;
-                        dcmp.~vector();
+                        charvec().swap(dcmp);
                         break;
                     }
                 }
@@ -583,10 +1723,14 @@ charvec createpatch(std::ifstream ogfile, std::ifstream edfile, bool header, uin
             seek(ed, -len(cmp), 1, edmax, edpos);
             readed = read(ed, chsize, edpos, edmax);
             dat.insert(dat.end(), readed.begin(), readed.end());
-            cmp.~vector();
-            readed.~vector();
+            charvec().swap(cmp);
+            charvec().swap(readed);
+            if (patchbudget >= 0 && (int64)(outbuf.size() + dat.size()) > patchbudget) { //every step here searches the rest of og
+                overbudget = true;
+                return charvec();
+            }
         }
-        full.~vector();
+        charvec().swap(full);
         publish(dat, found - loc, !first, loc);
     }
     if (read(og, 1, ogpos, ogmax).size()) {
@@ -595,16 +1739,19 @@ charvec createpatch(std::ifstream ogfile, std::ifstream edfile, bool header, uin
         charvec empty = charvec();
         publish(empty, len(read(og, ogmax, ogpos, ogmax)), false, loc);
     }
-    if (memory) {
-        delete[] og;
-        delete[] ed;
-    }
     if (!count) return charvec();
     charvec final;
     if (header) {
-        final.push_back('X'); final.push_back('X'); final.push_back('X'); final.push_back(0);
+        final.push_back('X'); final.push_back('X'); final.push_back('X'); final.push_back(pflags);
+        if (pflags & PF_HASH) final.push_back(hashalgo);
+    }
+    writedigest(final, crcval); //crc
+    if (pflags & PF_TARGET) writedigest(final, target);
+    if (pflags & PF_BLOCKS) {
+        writeint(final, blockshift, 1);
+        writeint(final, blocks.size(), 4);
+        for (const Digest& b : blocks) writedigest(final, b);
     }
-    writeint(final, crcval, 4); //crc
     writeint(final, (((bytecount[2]) << 4 ) | bytecount[1]), 1);
     writeint(final, count, 2);
     int last = 0;
@@ -628,10 +1775,8 @@ charvec createpatch(std::ifstream ogfile, std::ifstream edfile, bool header, uin
 }
 
 charvec applypatch(std::ifstream ogfile, std::ifstream ptfile, bool header, int& code) {
-    charvec outbuf;
     byte *og, *pt;
-    int64 ogpos = 0, ptpos = 0, ogmax = 0, ptmax = 0;
-    short count = 0;
+    int64 ogmax = 0, ptmax = 0;
     ogfile.seekg(0, 2);
     ptfile.seekg(0, 2);
     ogmax = ogfile.tellg();
@@ -650,39 +1795,98 @@ charvec applypatch(std::ifstream ogfile, std::ifstream ptfile, bool header, int&
         og = (byte*)&ogfile;
         pt = (byte*)&ptfile;
     }
-    bytecount[0] = getbytes(ogmax);
-    uint32_t crcval;    
-    charvec readall;
-    if (memory)
-        readall = charvec(og, og + ogmax);
-    else {
-        readall = read(og, ogmax, ogpos, ogmax);
-        seek(og, 0, 0, ogmax, ogpos);
+    inmem = memory;
+    charvec r = applypatch(og, ogmax, pt, ptmax, header, code);
+    if (memory) {
+        delete[] og;
+        delete[] pt;
     }
-    crcval = CRC::Calculate(readall.data(), ogmax, CRC::CRC_32());
-    readall.~vector();
+    return r;
+}
+
+//og and pt are buffers or ifstream*s depending on inmem, so a slice of a bigger patch can be passed as is
+charvec applypatch(byte* og, int64 ogmax, byte* pt, int64 ptmax, bool header, int& code) {
+    charvec outbuf;
+    int64 ogpos = 0, ptpos = 0;
+    short count = 0;
+    bytecount[0] = getbytes(ogmax);
     auto readint = [&](int size) {
         return vectoint(read(pt, size, ptpos, ptmax));
     };
     if (header) {
         charvec h = read(pt, 4, ptpos, ptmax);
-        if (h != charvec({'X', 'X', 'X', 0})) {
-            printf("header doesn't match\n");
+        if (h.size() < 4 || h[0] != 'X' || h[1] != 'X' || h[2] != 'X' || (h[3] & 0x80) || (h[3] & ~PF_KNOWN)) {
+            *logto << "header doesn't match" << std::endl;
+            code = 1;
+            return charvec();
+        }
+        pflags = h[3];
+        hashalgo = (pflags & PF_HASH) ? readint(1) : HASH_CRC32;
+        if (hashalgo >= HASH_COUNT) {
+            *logto << "unknown hash type" << std::endl;
             code = 1;
             return charvec();
         }
     }
-    if (crcval != readint(4)) {
-        printf("crc value does not match\n");
-        if (memory) {
-            delete[] og;
-            delete[] pt;
+    auto readdigest = [&]() {
+        Digest d;
+        d.lo = readint(MIN(hashsize(), 8));
+        if (hashsize() > 8) d.hi = readint(hashsize() - 8);
+        return d;
+    };
+    Digest crcval = readdigest();
+    Digest target = (pflags & PF_TARGET) ? readdigest() : Digest();
+    Hasher outhash;
+    std::vector<Digest> blocks;
+    std::vector<bool> checked;
+    byte bshift = 0; //local, every worker may be reading a different patch
+    if (pflags & PF_BLOCKS) { //checked lazily, only where we actually read the original
+        bshift = readint(1);
+        blocks.resize(readint(4));
+        for (Digest& b : blocks) b = readdigest();
+        checked.resize(blocks.size());
+    }
+    else {
+        Hasher c;
+        if (inmem)
+            c.update(og, ogmax);
+        else { //go through it in slices so we dont need the whole file in memory
+            while (ogpos < ogmax) {
+                charvec slice = read(og, (int)MIN(CRCCHUNK * (int64)threadcount(), 0x40000000), ogpos, ogmax);
+                c.update(slice.data(), slice.size());
+            }
+            seek(og, 0, 0, ogmax, ogpos);
+        }
+        if (c.digest() != crcval) {
+            *logto << "checksum of the original does not match" << std::endl;
+            code = 2;
+            return charvec();
         }
-        code = 2;
-        return charvec();
     }
+    auto verify = [&](int64 from, int64 size) {
+        if (!(pflags & PF_BLOCKS) || size <= 0) return true;
+        if (from + size > ((int64)blocks.size() << bshift)) {
+            *logto << "original is bigger than the one the patch was made for" << std::endl;
+            return false;
+        }
+        for (int64 b = from >> bshift; b <= (from + size - 1) >> bshift; b++) {
+            if (checked[b]) continue;
+            if (blockhash(og, b, bshift, ogmax, ogpos) != blocks[b]) {
+                *logto << "original does not match in block " << std::dec << b << std::hex << " (0x" << (b << bshift)
+                    << "-0x" << MIN((b + 1) << bshift, ogmax) << ")" << std::endl;
+                return false;
+            }
+            checked[b] = true;
+        }
+        return true;
+    };
+    auto fail = [&](int c) {
+        code = c;
+        return charvec();
+    };
     byte hb = readint(1);
     std::vector<std::map<std::string, int64>> inftbl;
+    std::vector<Digest> payloads;
     bytecount[1] = hb & 0xF;
     bytecount[2] = hb >> 4;
     int64 mask = ((int64)1 << ((bytecount[1] * 8) - 1));
@@ -697,6 +1901,10 @@ charvec applypatch(std::ifstream ogfile, std::ifstream ptfile, bool header, int&
             tmp.emplace("typ", readint(1));
             if (tmp["typ"]) tmp.emplace("ulen", readint(bytecount[2]));
             tmp.emplace("clen", readint(bytecount[2]));
+            if (pflags & PF_BLOCKS) {
+                tmp.emplace("phash", payloads.size());
+                payloads.push_back(readdigest());
+            }
             tmp.emplace("off", ptpos);
             seek(pt, tmp["clen"] + (tmp["typ"] == 2 ? 5 : 0), 1, ptmax, ptpos);
         }
@@ -709,15 +1917,21 @@ charvec applypatch(std::ifstream ogfile, std::ifstream ptfile, bool header, int&
         last = inftbl[i]["pos"] + inftbl[i]["len"];
     }
     for (uint i = 0; i < safelist.size(); i++) {
+        if (!verify(ogpos, safelist[i])) return fail(2);
         charvec ogread = read(og, safelist[i], ogpos, ogmax);
         charvec dat;
         outbuf.insert(outbuf.end(), ogread.begin(), ogread.end());
+        if (pflags & PF_TARGET) outhash.update(ogread.data(), ogread.size());
         std::map<std::string, int64> info = inftbl[0];
         inftbl.erase(inftbl.begin());
         seek(og, info["len"], 1, ogmax, ogpos);
         if (info["add"]) {
             seek(pt, info["off"], 0, ptmax, ptpos);
             dat = read(pt, info["clen"], ptpos, ptmax);
+            if ((pflags & PF_BLOCKS) && hashbuf(dat.data(), dat.size()) != payloads[info["phash"]]) {
+                *logto << "replacement #" << std::dec << i + 1 << " in the patch is corrupt" << std::endl;
+                return fail(4);
+            }
             if (info["typ"]) {
                 byte* out = new byte[info["ulen"]];
                 if (info["typ"] == 1) {
@@ -734,18 +1948,24 @@ charvec applypatch(std::ifstream ogfile, std::ifstream ptfile, bool header, int&
                 delete[] out;
             }
             outbuf.insert(outbuf.end(), dat.begin(), dat.end());
+            if (pflags & PF_TARGET) outhash.update(dat.data(), dat.size());
         }
         using namespace std;
-        cout << (info["add"] ? "REPLACE " : "REMOVED ") << "AT POS " << hex << info["pos"] << " OGLEN " << info["len"];
-        if (info["add"]) cout << " EDLEN " << hex << dat.size();
-        cout << endl;
+        *logto << (info["add"] ? "REPLACE " : "REMOVED ") << "AT POS " << hex << info["pos"] << " OGLEN " << info["len"];
+        if (info["add"]) *logto << " EDLEN " << hex << dat.size();
+        *logto << endl;
     }
+    if (!verify(ogpos, ogmax - ogpos)) return fail(2);
     charvec rest = read(og, ogmax, ogpos, ogmax);
-    if (memory) {
-        delete[] pt;
-        delete[] og;
-    }
     outbuf.insert(outbuf.end(), rest.begin(), rest.end());
+    if (pflags & PF_TARGET) {
+        outhash.update(rest.data(), rest.size());
+        if (outhash.digest() != target) {
+            *logto << "output does not match the patch's target checksum" << std::endl;
+            code = 5;
+            return charvec();
+        }
+    }
     code = 0;
     return outbuf;
     
@@ -0,0 +1,88 @@
+#pragma once
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <unordered_map>
+#include "util.h"
+#include "fasthash.h"
+
+//QUICK SKIP MANIFEST
+//a cache of fast128 hashes of files we've already read, keyed by full path. an entry only counts while
+//the file's size, mtime and inode are still what they were when it was hashed, so two unchanged files
+//with the same hash can be called identical without reading either of them
+//format: "XXM" version(1) count(8), then per entry pathlen(2) path size(8) mtime(8) inode(8) hash(16)
+#define MANIFEST_VERSION 1
+#define MANIFEST_RACY 2000000000 //ns, files touched this close to the run's start aren't trusted next time
+
+struct ManifestEntry {
+    int64 size;
+    int64 mtime;
+    uint64_t inode;
+    Digest hash;
+};
+
+struct Manifest {
+    bool load(const std::string& path) {
+        std::ifstream f(path, std::ios::binary | std::ios::in);
+        if (!f) return false;
+        charvec v((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        int64 pos = 0;
+        charvec magic = readvec(v, 4, pos);
+        if (magic.size() < 4 || magic[0] != 'X' || magic[1] != 'X' || magic[2] != 'M' || magic[3] != MANIFEST_VERSION) return false;
+        int64 count = readintvec(v, 8, pos);
+        for (int64 i = 0; i < count && pos < (int64)v.size(); i++) {
+            int plen = (int)readintvec(v, 2, pos);
+            charvec p = readvec(v, plen, pos);
+            ManifestEntry e;
+            e.size = readintvec(v, 8, pos);
+            e.mtime = readintvec(v, 8, pos);
+            e.inode = readintvec(v, 8, pos);
+            e.hash.lo = readintvec(v, 8, pos);
+            e.hash.hi = readintvec(v, 8, pos);
+            old[std::string(p.begin(), p.end())] = e;
+        }
+        return true;
+    }
+    //the cached hash if the file still looks the way it did, else null
+    const ManifestEntry* lookup(const std::string& key, const Dir* d) const {
+        auto it = old.find(key);
+        if (it == old.end()) return nullptr;
+        const ManifestEntry& e = it->second;
+        if (e.size != d->filesize || e.mtime != d->mtime || e.inode != d->inode) return nullptr;
+        return &e;
+    }
+    //only what got put this run is saved, so files that went away drop out on their own
+    void put(const std::string& key, const Dir* d, Digest hash) {
+        fresh[key] = { d->filesize, d->mtime, d->inode, hash };
+    }
+    //written next to the old one and renamed over it so a crash can't leave half a manifest
+    bool save(const std::string& path, int64 stamp) {
+        charvec v = { 'X', 'X', 'M', MANIFEST_VERSION };
+        int64 count = 0;
+        writeint(v, 0, 8);
+        for (const auto& kv : fresh) {
+            const ManifestEntry& e = kv.second;
+            if (e.mtime > stamp - MANIFEST_RACY || kv.first.size() > 0xFFFF) continue;
+            writeint(v, kv.first.size(), 2);
+            v.insert(v.end(), kv.first.begin(), kv.first.end());
+            writeint(v, e.size, 8);
+            writeint(v, e.mtime, 8);
+            writeint(v, e.inode, 8);
+            writeint(v, e.hash.lo, 8);
+            writeint(v, e.hash.hi, 8);
+            count++;
+        }
+        for (int i = 0; i < 8; i++) v[4 + i] = (count >> (i * 8)) & 0xFF;
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream f(tmp, std::ios::binary | std::ios::out | std::ios::trunc);
+            if (!f.write((char*)v.data(), v.size())) return false;
+        }
+#ifdef _WIN32
+        std::remove(path.c_str()); //rename won't replace on windows
+#endif
+        return !std::rename(tmp.c_str(), path.c_str());
+    }
+
+    std::unordered_map<std::string, ManifestEntry> old, fresh;
+};
@@ -0,0 +1,74 @@
+#pragma once
+#include <string>
+#include "util.h"
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+//MAPPED FILES
+//read only view of a whole file so checksumming, comparing and diffing all read the same pages instead
+//of each pulling the file through its own stream. data is null when the file couldn't be opened or
+//mapped, callers go back to streams then. an empty file maps to a valid empty view
+struct MappedFile {
+    MappedFile(const std::string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE) return;
+        LARGE_INTEGER fs;
+        if (!GetFileSizeEx(file, &fs)) return;
+        size = fs.QuadPart;
+        if (!size) {
+            data = &empty;
+            return;
+        }
+        map = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!map) return;
+        data = (byte*)MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+#else
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        struct stat f;
+        if (!fstat(fd, &f)) {
+            size = f.st_size;
+            if (!size) data = &empty;
+            else {
+                void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    madvise(p, size, MADV_SEQUENTIAL);
+                    data = (byte*)p;
+                }
+            }
+        }
+        close(fd); //the mapping keeps its own reference
+#endif
+    }
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data && data != &empty) UnmapViewOfFile(data);
+        if (map) CloseHandle(map);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (data && data != &empty) munmap(data, size);
+#endif
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    byte* data = nullptr;
+    int64 size = 0;
+    byte empty = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE map = NULL;
+#endif
+};
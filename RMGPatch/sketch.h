@@ -0,0 +1,135 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include "util.h"
+#include "fasthash.h"
+
+//SIMILARITY SKETCHES
+//a file is cut into content defined chunks (gear hash, so an insertion only moves the cuts next to it)
+//and its sketch is the SK_SIZE smallest chunk hashes, a bottom-k minhash. two files sharing a lot of
+//chunks share a lot of sketch entries, so a file's best base is whoever shares the most
+#define SK_SIZE 64
+#define SK_MASK 0x1FF //~512 byte chunks
+#define SK_MINCHUNK 64
+#define SK_MAXCHUNK 0x4000
+//bigger chunks for deduplicating added files, a chunk gets its own record so they can't be too small
+#define DD_MASK 0x3FFF //~16KB
+#define DD_MINCHUNK 0x800
+#define DD_MAXCHUNK 0x10000
+
+inline const uint64_t* geartable() {
+    static uint64_t t[256];
+    static bool init = [] {
+        uint64_t x = 0x6A09E667F3BCC909ULL;
+        for (int i = 0; i < 256; i++) { //splitmix64
+            uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            t[i] = z ^ (z >> 31);
+        }
+        return true;
+    }();
+    (void)init;
+    return t;
+}
+
+//calls fn(start, len) for every content defined chunk of p, cut where the low bits of a gear hash are 0
+template <typename F>
+void chunkbuf(const byte* p, int64 size, uint64_t mask, int64 minchunk, int64 maxchunk, F fn) {
+    const uint64_t* gear = geartable();
+    int64 start = 0;
+    uint64_t h = 0;
+    for (int64 i = 0; i < size; i++) {
+        h = (h << 1) + gear[p[i]];
+        int64 len = i + 1 - start;
+        if ((len >= minchunk && !(h & mask)) || len >= maxchunk || i == size - 1) {
+            fn(start, len);
+            start = i + 1;
+            h = 0;
+        }
+    }
+}
+
+typedef std::vector<uint64_t> Sketch; //sorted, no duplicates
+
+Sketch sketchbuf(const byte* p, int64 size) {
+    Sketch s;
+    auto trim = [&] {
+        std::sort(s.begin(), s.end());
+        s.erase(std::unique(s.begin(), s.end()), s.end());
+        if (s.size() > SK_SIZE) s.resize(SK_SIZE);
+    };
+    chunkbuf(p, size, SK_MASK, SK_MINCHUNK, SK_MAXCHUNK, [&](int64 start, int64 len) {
+        s.push_back(fasthash64(p + start, len));
+        if (s.size() >= SK_SIZE * 8) trim();
+    });
+    trim();
+    return s;
+}
+
+//coverage only looks at this many windows of each file, so a big file costs about what a 2MB one does
+#define CV_WINDOWS 32
+#define CV_WINDOW 0x10000 //64KB
+
+//calls fn(at, len, whole) for CV_WINDOWS windows spread evenly over size bytes, or once for all of it
+//when that's no more
+template <typename F>
+void samplewindows(int64 size, F fn) {
+    if (size <= CV_WINDOWS * CV_WINDOW) return fn(0, size, true);
+    for (int i = 0; i < CV_WINDOWS; i++) fn((size - CV_WINDOW) / (CV_WINDOWS - 1) * i, CV_WINDOW, false);
+}
+
+//rough share of ed that's also somewhere in og: how many of the chunks in ed's windows are among the
+//chunks in og's. one that's in a part of og no window saw can't be found, so the hits are scaled up by
+//how much of og was looked at
+double coverage(const byte* og, int64 ogsize, const byte* ed, int64 edsize) {
+    std::unordered_set<uint64_t> want, have;
+    samplewindows(edsize, [&](int64 at, int64 len, bool whole) {
+        std::vector<uint64_t> got;
+        chunkbuf(ed + at, len, SK_MASK, SK_MINCHUNK, SK_MAXCHUNK, [&](int64 start, int64 n) {
+            got.push_back(fasthash64(ed + at + start, n));
+        });
+        //a window's first and last chunks are cut by its edges, not by what's in it
+        size_t skip = whole ? 0 : 1;
+        for (size_t i = skip; i + skip < got.size(); i++) want.insert(got[i]);
+    });
+    if (want.empty()) return 1;
+    int64 seen = 0;
+    samplewindows(ogsize, [&](int64 at, int64 len, bool) {
+        seen += len;
+        chunkbuf(og + at, len, SK_MASK, SK_MINCHUNK, SK_MAXCHUNK, [&](int64 start, int64 n) {
+            have.insert(fasthash64(og + at + start, n));
+        });
+    });
+    int64 hits = 0;
+    for (uint64_t v : want) hits += have.count(v);
+    return std::min(1.0, (double)hits / want.size() * ogsize / MAX(seen, 1));
+}
+
+//inverted index from sketch entries to the files that have them
+struct SketchIndex {
+    void add(int id, const Sketch& s) {
+        for (uint64_t v : s) index[v].push_back(id);
+    }
+    //the file sharing the most entries with s, -1 if none shares at least minshare
+    int best(const Sketch& s, int minshare, int& share) const {
+        std::unordered_map<int, int> hits;
+        for (uint64_t v : s) {
+            auto it = index.find(v);
+            if (it == index.end()) continue;
+            for (int id : it->second) hits[id]++;
+        }
+        int r = -1;
+        share = 0;
+        for (const auto& h : hits)
+            if (h.second > share || (h.second == share && h.first < r)) {
+                r = h.first;
+                share = h.second;
+            }
+        if (share < minshare) r = -1;
+        return r;
+    }
+    std::unordered_map<uint64_t, std::vector<int>> index;
+};
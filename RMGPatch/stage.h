@@ -0,0 +1,144 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <filesystem>
+#include "util.h"
+#include "threads.h"
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+//STAGED WRITES
+//with --stage every file a directory apply writes goes to a temp file next to it. once they're all
+//written they're made durable together, then renamed over the real ones and that's made durable too.
+//renames and removals only happen after that. a crash leaves each file either as it was or as it should
+//be, never half written, and it costs a sync or two instead of one per file
+#define STAGE_SUFFIX ".rmgstage"
+static bool staging = false;
+
+//makes what's been written to paths durable. linux syncs each filesystem they're on in one go, elsewhere
+//every file is flushed on its own, all at once on the pool. dirs says paths are directories. false if
+//any of it couldn't be opened or synced
+bool syncpaths(const std::vector<std::string>& paths, bool dirs) {
+#ifdef __linux__
+    (void)dirs; //syncfs takes the directories along
+    bool ok = true;
+    std::set<dev_t> seen;
+    for (const std::string& p : paths) {
+        struct stat f;
+        if (stat(p.c_str(), &f)) {
+            ok = false;
+            continue;
+        }
+        if (!seen.insert(f.st_dev).second) continue;
+        int fd = open(p.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            ok = false;
+            continue;
+        }
+        if (syncfs(fd)) ok = false;
+        close(fd);
+    }
+    return ok;
+#elif defined(_WIN32)
+    if (dirs) return true; //ntfs journals its renames
+    std::atomic<bool> ok(true);
+    parallelfor(paths.size(), [&](int64 i) {
+        HANDLE h = CreateFileA(paths[i].c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+        if (h == INVALID_HANDLE_VALUE) {
+            ok = false;
+            return;
+        }
+        if (!FlushFileBuffers(h)) ok = false;
+        CloseHandle(h);
+    });
+    return ok;
+#else
+    std::atomic<bool> ok(true);
+    parallelfor(paths.size(), [&](int64 i) {
+        int fd = open(paths[i].c_str(), O_RDONLY);
+        if (fd < 0) {
+            ok = false;
+            return;
+        }
+        if (dirs ? fsync(fd) : fdatasync(fd)) ok = false;
+        close(fd);
+    });
+    return ok;
+#endif
+}
+
+//gives the temp the mode and owner of the file it's replacing, a rename would take the temp's defaults
+//over. false if it can't be done, a new file is left as it is
+inline bool keepattrs(const std::string& temp, const std::string& path) {
+#ifdef _WIN32
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::file_status s = fs::status(path, ec);
+    if (ec) return true;
+    fs::permissions(temp, s.permissions(), ec);
+    return !ec;
+#else
+    struct stat s, t;
+    if (stat(path.c_str(), &s)) return true;
+    if (stat(temp.c_str(), &t)) return false;
+    //owner first, a chown drops setuid and setgid
+    if ((s.st_uid != t.st_uid || s.st_gid != t.st_gid) && chown(temp.c_str(), s.st_uid, s.st_gid)) return false;
+    return !chmod(temp.c_str(), s.st_mode & 07777);
+#endif
+}
+
+struct Stager {
+    //where entry k's file at path gets written: a temp next to it when staging, else the file itself
+    std::string to(const std::string& path, int64 k) {
+        if (!staging) return path;
+        std::lock_guard<std::mutex> l(m);
+        files.push_back({ path, k });
+        return path + STAGE_SUFFIX;
+    }
+    //gives the temp of every entry that didn't fail the attributes of the file it replaces and syncs them,
+    //renames them into place and syncs that, removes the rest. returns the entries that couldn't be moved,
+    //which is all of them when the temps couldn't be synced. durable says whether they could, synced
+    //whether the renames were
+    std::vector<int64> commit(const std::vector<byte>& failed) {
+        namespace fs = std::filesystem;
+        std::vector<int64> bad;
+        if (files.empty()) return bad;
+        std::vector<std::string> temps, kept; //a failed entry may not have a temp at all
+        std::set<std::string> parents;
+        std::vector<byte> attrs(files.size());
+        for (size_t i = 0; i < files.size(); i++) {
+            temps.push_back(files[i].first + STAGE_SUFFIX);
+            if (failed[files[i].second]) continue;
+            kept.push_back(temps[i]);
+            parents.insert(fs::path(files[i].first).parent_path().string());
+            attrs[i] = keepattrs(temps[i], files[i].first);
+        }
+        durable = syncpaths(kept, false); //else a crash could leave a renamed one half written
+        for (size_t i = 0; i < files.size(); i++) {
+            std::error_code ec;
+            bool keep = !failed[files[i].second];
+            bool moved = durable && attrs[i] && (fs::rename(temps[i], files[i].first, ec), !ec);
+            if (keep && !moved) bad.push_back(files[i].second);
+            if (!moved) fs::remove(temps[i], ec);
+        }
+        synced = syncpaths(std::vector<std::string>(parents.begin(), parents.end()), true);
+        return bad;
+    }
+
+    std::mutex m;
+    bool durable = true, synced = true;
+    std::vector<std::pair<std::string, int64>> files;
+};
@@ -0,0 +1,96 @@
+#pragma once
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include "util.h"
+
+static int threads = 0; //0 = one per core
+
+inline int threadcount() {
+    if (threads > 0) return threads;
+    int hc = (int)std::thread::hardware_concurrency();
+    return hc > 0 ? hc : 1;
+}
+
+//run fn(i) for i in [0, count) on up to maxthreads workers (0 = threadcount()).
+//indices are handed out in order so callers can front-load the expensive ones
+template <typename F>
+void parallelfor(int64 count, F fn, int maxthreads = 0) {
+    if (count <= 0) return;
+    int n = maxthreads > 0 ? maxthreads : threadcount();
+    n = (int)MIN(n, count);
+    if (n <= 1) {
+        for (int64 i = 0; i < count; i++) fn(i);
+        return;
+    }
+    std::atomic<int64> next(0);
+    auto work = [&] {
+        for (int64 i; (i = next++) < count;) fn(i);
+    };
+    std::vector<std::thread> pool;
+    for (int i = 1; i < n; i++) pool.emplace_back(work);
+    work();
+    for (auto& t : pool) t.join();
+}
+
+//counting semaphore for capping how many workers are in a cpu heavy section at once
+struct Gate {
+    Gate(int n) : left{ n } {}
+    void enter() {
+        std::unique_lock<std::mutex> l(m);
+        cv.wait(l, [&] { return left > 0; });
+        left--;
+    }
+    void leave() {
+        {
+            std::lock_guard<std::mutex> l(m);
+            left++;
+        }
+        cv.notify_one();
+    }
+    std::mutex m;
+    std::condition_variable cv;
+    int left;
+};
+struct GateLock {
+    GateLock(Gate& g) : gate{ g } { gate.enter(); }
+    ~GateLock() { gate.leave(); }
+    Gate& gate;
+};
+
+//like parallelfor but for work that turns up as it goes: fn(item, push) can push(T) more items.
+//returns once the queue is empty and no worker is still running
+template <typename T, typename F>
+void parallelqueue(std::vector<T> work, F fn, int maxthreads = 0) {
+    if (work.empty()) return;
+    int n = maxthreads > 0 ? maxthreads : threadcount();
+    std::mutex m;
+    std::condition_variable cv;
+    int busy = 0;
+    auto push = [&](T item) {
+        {
+            std::lock_guard<std::mutex> l(m);
+            work.push_back(std::move(item));
+        }
+        cv.notify_one();
+    };
+    auto run = [&] {
+        std::unique_lock<std::mutex> l(m);
+        for (;;) {
+            cv.wait(l, [&] { return !work.empty() || !busy; });
+            if (work.empty()) break;
+            T item = std::move(work.back());
+            work.pop_back();
+            busy++;
+            l.unlock();
+            fn(item, push);
+            l.lock();
+            if (!--busy && work.empty()) cv.notify_all();
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int i = 1; i < n; i++) pool.emplace_back(run);
+    run();
+    for (auto& t : pool) t.join();
+}
@@ -6,6 +6,9 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <memory>
+#include <deque>
+#include <algorithm>
+#include <unordered_map>
 
 //#define _DEBUG
 #if defined(_DEBUG) && defined(_WIN32)
@@ -25,6 +28,9 @@ inline int64 MAX(int64 a, int64 b) { return((a) > (b) ? a : b); }
 inline int64 MIN(int64 a, int64 b) { return((a) < (b) ? a : b); }
 
 static int memory = 2;
+//whether read()/seek() get a buffer or an ifstream* on this thread. whoever starts on a file sets it,
+//a mapped file is a buffer even with memory off
+static thread_local bool inmem = false;
 
 //QUICK UTIL FUNCS
 inline int64 len(charvec vector) { return vector.size(); }
@@ -42,6 +48,11 @@ void writeint(charvec& vector, int64 in, int size) {
         in >>= 8;
     }
 }
+//7 bits a byte, low first, high bit set on all but the last
+void writevarint(charvec& vector, uint64_t in) {
+    for (; in >= 0x80; in >>= 7) vector.push_back((in & 0x7F) | 0x80);
+    vector.push_back(in);
+}
 uint64_t vectoint(charvec vector) {
     uint64_t ret = 0;
     for (int i = vector.size(); i-- > 0;) {
@@ -76,7 +87,7 @@ std::string join(std::vector<std::string> sv, std::string joined) {
 charvec read(byte* mem, int len, int64& pos, int64 max) {
     int count = (int)MIN(max - pos, len);
     byte* buf = new byte[count];
-    if (memory) memcpy(buf, (void*)(mem + pos), count);
+    if (inmem) memcpy(buf, (void*)(mem + pos), count);
     else (*(std::ifstream*)mem).read((char*)buf, count);
     pos += count;
     charvec ret(buf, buf + count);
@@ -87,85 +98,168 @@ int64 seek(byte* mem, int64 pos, int whence, int64 max, int64& posref) {
     if (!whence) posref = MIN(max, pos);
     else if (whence == 1) posref = MAX(MIN(max, posref + pos), 0);
     else if (whence == 2) posref = MAX(max - pos, 0);
-    if (!memory) (*(std::ifstream*)mem).seekg(pos, whence);
+    if (!inmem) (*(std::ifstream*)mem).seekg(pos, whence);
     return posref;
 }
-charvec readvec(charvec& vector, int len, int64& pos) {
-    int count = (int)MIN(vector.size() - pos, len);
-    charvec res(vector.begin() + pos, vector.begin() + pos + count);
+//read only window into bytes someone else owns, a mapped patch or a whole buffer
+struct ByteView {
+    ByteView(const byte* d = nullptr, int64 s = 0) : data{ d }, size{ s } {}
+    ByteView(const charvec& v) : data{ v.data() }, size{ (int64)v.size() } {}
+    const byte* data;
+    int64 size;
+};
+charvec readvec(ByteView vector, int64 len, int64& pos) {
+    int64 count = MAX(MIN(vector.size - pos, len), 0);
+    charvec res(vector.data + pos, vector.data + pos + count);
     pos += count;
     return res;
 }
-inline uint64_t readintvec(charvec& vector, int len, int64& pos) {
+inline uint64_t readintvec(ByteView vector, int len, int64& pos) {
     return vectoint(readvec(vector, len, pos));
 }
+inline uint64_t readvarint(ByteView vector, int64& pos) {
+    uint64_t r = 0;
+    for (int shift = 0; pos < vector.size && shift < 64; shift += 7) {
+        byte b = vector.data[pos++];
+        r |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) break;
+    }
+    return r;
+}
+//fixed width when size isn't 0, varint when it is
+inline void writenum(charvec& vector, int64 in, int size) {
+    if (size) writeint(vector, in, size);
+    else writevarint(vector, in);
+}
+inline uint64_t readnum(ByteView vector, int size, int64& pos) {
+    return size ? readintvec(vector, size, pos) : readvarint(vector, pos);
+}
 
 //DIRECTORIES
+//entry types in a directory patch's header
+#define ET_CHANGED  0
+#define ET_ADDED    1 //how it's stored in the high nibble: 0 as is, 1 zlib, 2 lzma, 3 chunks, 4 in a solid block
+#define ET_REMOVED  2
+#define ET_MOVED    3 //same content as a file the patch removes, its path follows
+#define ET_DELTA    4 //patch against another file of the original (moved from or just similar), offset [size] then its path
+#define ET_RMTREE   5 //a directory that goes with everything in it
+#define ET_ADDTREE  6 //a new directory, offset of one packed stream with everything in it
+#define ET_REPLACED 7 //a changed file that's stored whole because diffing it didn't pay, offset of a packed block
+#define ET_KEEP     0x10 //on ET_MOVED: copy it, the source is still needed or stays
+//a tree is one flat table of nodes owned by a DirTree, node 0 is the root. names are interned once per
+//tree, children are looked up through a single hash on (parent, name) and every node keeps where its
+//full path sits in a shared pool, so nothing has to split, join or walk up to build a path
+struct DirTree;
 struct Dir {
-    inline Dir() {
-        initialized = false;
-        parent = nullptr; //shut UP
+    const std::string& name() const;
+    std::string path() const;
+
+    DirTree* tree = nullptr;
+    Dir* parent = nullptr;
+    uint id = 0;
+    uint nameid = 0;
+    int64 pathpos = 0;
+    uint pathlen = 0;
+    std::vector<Dir*> children;
+    int64 filesize = -1;
+    int64 mtime = 0; //ns, only filled in by the scanner
+    uint64_t inode = 0;
+    bool isdir = true;
+    byte added = 0; //additions: 1 + how it's stored
+    byte moved = 0; //ET_MOVED (maybe | ET_KEEP), ET_DELTA, ET_REPLACED or a subtree type. moves and deltas have a source path in tree->sources[from]
+    int from = -1;
+    int64 patchlen = -1; //dir patches: size of a changed file's patch, -1 when it's in front of the patch instead
+};
+
+struct DirTree {
+    DirTree() {
+        nodes.emplace_back();
+        nodes[0].tree = this;
+        names.push_back(&nameids.emplace("", 0).first->first);
     }
-    inline Dir(std::string n, Dir* p = new Dir()) :
-        name{ n }, parent{ p } { initialized = true; };
+    DirTree(const DirTree&) = delete;
+    DirTree& operator=(const DirTree&) = delete;
 
-    std::string path() {
-        Dir* cdir = this;
-        std::string res;
-        while (cdir->initialized) {
-            res.insert(0, cdir->name);
-            res.insert(0, "/");
-            cdir = cdir->parent;
-        }
-        res.erase(0, 1);
-        return res;
+    Dir* root() { return &nodes[0]; }
+    uint intern(const std::string& s) {
+        auto it = nameids.emplace(s, (uint)names.size());
+        if (it.second) names.push_back(&it.first->first);
+        return it.first->second;
     }
-    std::vector<std::string> walklist(bool includedir = false) {
-        std::vector<std::string> ret;
-        for (auto itr = this->children.begin(); itr != this->children.end(); itr++) {
-            auto inpth = itr->get();
-            if (includedir || (!includedir && !inpth->isdir)) ret.push_back(inpth->path());
-            if (inpth->isdir) {
-                std::vector<std::string> recur = inpth->walklist();
-                ret.insert(ret.end(), recur.begin(), recur.end());
-            }
+    static uint64_t key(const Dir* parent, uint nameid) { return ((uint64_t)parent->id << 32) | nameid; }
+    Dir* child(Dir* parent, const std::string& name) {
+        auto n = nameids.find(name);
+        if (n == nameids.end()) return nullptr;
+        auto c = index.find(key(parent, n->second));
+        return c == index.end() ? nullptr : c->second;
+    }
+    //appends a new child, doesn't check for an existing one
+    Dir* add(Dir* parent, const std::string& name, bool isdir = true) {
+        nodes.emplace_back();
+        Dir* d = &nodes.back();
+        d->tree = this;
+        d->parent = parent;
+        d->id = (uint)(nodes.size() - 1);
+        d->nameid = intern(name);
+        d->isdir = isdir;
+        d->pathpos = paths.size();
+        paths.reserve(paths.size() + parent->pathlen + 1 + name.size());
+        if (parent->pathlen) {
+            paths.append(paths.data() + parent->pathpos, parent->pathlen);
+            paths.push_back('/');
         }
-        return ret;
+        paths.append(name);
+        d->pathlen = (uint)(paths.size() - d->pathpos);
+        index.emplace(key(parent, d->nameid), d);
+        parent->children.push_back(d);
+        return d;
     }
-    Dir* find(std::string path, bool create) {
-        if (path == "") {
-            return this;
+    //nullptr if it's not there and create is off
+    Dir* find(const std::string& path, bool create, Dir* from = nullptr) {
+        Dir* d = from ? from : root();
+        std::string part;
+        for (size_t start = 0, end; d && start < path.size(); start = end + 1) {
+            end = path.find('/', start);
+            if (end == std::string::npos) end = path.size();
+            part.assign(path, start, end - start);
+            Dir* c = child(d, part);
+            if (!c && create) c = add(d, part);
+            d = c;
         }
-        auto spl = split(path, '/');
-        for (auto itr = this->children.begin(); itr != this->children.end(); itr++) {
-            auto p = (itr->get());
-            if (p->name == spl[0]) {
-                spl.erase(spl.begin());
-                return p->find(join(spl, "/"), create);
+        return d;
+    }
+    std::vector<std::string> walklist(bool includedir = false, Dir* from = nullptr) {
+        std::vector<std::string> ret;
+        std::vector<std::pair<Dir*, size_t>> stack = { { from ? from : root(), 0 } };
+        while (stack.size()) {
+            auto& top = stack.back();
+            if (top.second == top.first->children.size()) {
+                stack.pop_back();
+                continue;
             }
+            Dir* c = top.first->children[top.second++];
+            if (includedir || !c->isdir) ret.push_back(c->path());
+            if (c->isdir) stack.push_back({ c, 0 });
         }
-        if (!create) {
-            return new Dir();
-        }
-        Dir* pb = new Dir(spl[0], this);
-        this->children.push_back(std::unique_ptr<Dir>(pb));
-        spl.erase(spl.begin());
-        return this->children.back()->find(join(spl, "/"), create);
+        return ret;
     }
 
-    std::string name;
-    Dir* parent;
-    std::vector<std::unique_ptr<Dir>> children;
-    byte initialized = false;
-    int64 filesize = -1;
-    bool isdir = true;
+    std::deque<Dir> nodes; //deque so node pointers survive growth
+    std::unordered_map<std::string, uint> nameids;
+    std::vector<const std::string*> names;
+    std::unordered_map<uint64_t, Dir*> index;
+    std::string paths;
+    std::vector<std::string> sources; //where moved entries come from
 };
 
+inline const std::string& Dir::name() const { return *tree->names[nameid]; }
+inline std::string Dir::path() const { return tree->paths.substr(pathpos, pathlen); }
+
 struct DirIterator {
     inline DirIterator(Dir* dir) : current{ dir } {}
     Dir* next(bool enter = true) {
         if (enter && canenter) {
-            current = current->children[locs.back()].get();
+            current = current->children[locs.back()];
             locs.push_back(-1);
             deep++;
         }
@@ -180,7 +274,7 @@ struct DirIterator {
             return this->next();
         }
         canenter = current->children[locs.back()]->isdir;
-        return current->children[locs.back()].get();
+        return current->children[locs.back()];
     }
     Dir* current;
     bool canenter = false;
@@ -188,78 +282,137 @@ struct DirIterator {
     int deep = 0;
 };
 
-std::unique_ptr<Dir> filesystodir(std::string& rootstr) {
-    using namespace std;
-    using namespace std::filesystem;
-    string stbuf;
-    unique_ptr<Dir> rootdir = unique_ptr<Dir>(new Dir());
-#ifdef _WIN32 
-    string rcl;
-    istringstream rootstm(rootstr);
-    while (getline(rootstm, stbuf, '\\')) {
-        rcl.append(stbuf);
-        rcl.append("/");
+//one file's part of a header entry: type, offset, size, source path, whatever of those it has.
+//lens: there's a size of every changed file's patch after its offset (trailing headers have them).
+//fl is how wide offsets are, 0 for compact headers where every number is a varint
+void writeentry(charvec& to, Dir* x, byte fl, bool lens) {
+    byte typ = ET_CHANGED;
+    if (x->moved) typ = x->moved;
+    else if (x->added) typ = ET_ADDED | (((x->added & 0b111) - 1) << 4);
+    else if (x->filesize < 0) typ = ET_REMOVED;
+    to.push_back(typ);
+    if (typ != ET_REMOVED && typ != ET_RMTREE && (typ & 0xF) != ET_MOVED) writenum(to, x->filesize, fl);
+    if ((typ == ET_CHANGED || typ == ET_DELTA) && lens) writenum(to, x->patchlen, fl);
+    if ((typ & 0xF) == ET_MOVED || typ == ET_DELTA) {
+        const std::string& src = x->tree->sources[x->from];
+        writenum(to, src.size(), fl ? 2 : 0);
+        to.insert(to.end(), src.begin(), src.end());
     }
-    //rcl.pop_back();
-    rootstr = rcl;
-#else
-    //maybe smth here
-#endif
-    if (rootstr.back() != '/') rootstr.append("/");
-    for (recursive_directory_iterator i(rootstr), end; i != end; i++) {
-        auto path = i->path();
-        string fullpathstr = path.string();
-#ifdef _WIN32 
-        string filtered;
-        istringstream fpstm(fullpathstr);
-        while (getline(fpstm, stbuf, '\\')) {
-            filtered.append(stbuf);
-            filtered.append("/");
-        }
-        filtered.pop_back();
-        fullpathstr = filtered;
-#else
-        //do smth here for linux? hope not
-#endif
-        string pathstr = fullpathstr;
-        if (!pathstr.rfind(rootstr, 0)) {
-            pathstr.erase(0, rootstr.size());
-        }
-        Dir* d = rootdir->find(pathstr, true);
-        if (!is_directory(i->path())) {
-            struct stat f;
-            if (stat(path.string().c_str(), &f)) {
-                cout << "unable to open stat for file " << pathstr << endl;
-                return std::unique_ptr<Dir>();
-            }
-            d->filesize = f.st_size;
-            d->isdir = false;
+}
+void readentry(ByteView vector, int64& pos, byte fl, Dir* d, bool lens) {
+    byte typ = readintvec(vector, 1, pos);
+    if ((typ & 0xF) == ET_MOVED || typ == ET_DELTA) {
+        d->moved = typ;
+        d->filesize = typ == ET_DELTA ? readnum(vector, fl, pos) : 0;
+        if (typ == ET_DELTA && lens) d->patchlen = readnum(vector, fl, pos);
+        charvec src = readvec(vector, readnum(vector, fl ? 2 : 0, pos), pos);
+        d->from = d->tree->sources.size();
+        d->tree->sources.push_back(std::string(src.begin(), src.end()));
+    }
+    else if (typ == ET_RMTREE || typ == ET_ADDTREE || typ == ET_REPLACED) {
+        d->moved = typ;
+        if (typ != ET_RMTREE) d->filesize = readnum(vector, fl, pos);
+    }
+    else if (typ != ET_REMOVED) {
+        d->filesize = readnum(vector, fl, pos);
+        if (typ == ET_CHANGED && lens) d->patchlen = readnum(vector, fl, pos);
+        if ((typ & 0xF) == ET_ADDED) {
+            d->added = 1 + ((typ & 0xF0) >> 4);
         }
-        //cout << d->path() << endl;
     }
-    rootdir->filesize = 0; //use as return code of sorts
-    return rootdir;
 }
 
-void readdheader(charvec& vector, int64& pos, byte& fl, Dir* parent) {
+void readdheader(ByteView vector, int64& pos, byte& fl, Dir* parent, bool lens) {
     unsigned short count = readintvec(vector, 2, pos);
     for (uint i = 0; i < count; i++) {
         byte strc = readintvec(vector, 1, pos);
         charvec dirv = readvec(vector, strc & ~0x80, pos);
         std::string dirs(dirv.begin(), dirv.end());
-        parent->children.push_back(std::unique_ptr<Dir>(new Dir(dirs, parent)));
-        if (!(strc & 0x80))
-            readdheader(vector, pos, fl, parent->children.back().get());
-        else {
-            parent->children.back()->isdir = false;
-            byte typ = readintvec(vector, 1, pos);
-            if (typ != 2) {
-                parent->children.back()->filesize = readintvec(vector, fl, pos);
-                if ((typ & 0xF) == 1) {
-                    parent->children.back()->initialized = 2 + ((typ & 0xF0) >> 4);
-                }
+        Dir* d = parent->tree->add(parent, dirs, !(strc & 0x80));
+        if (d->isdir)
+            readdheader(vector, pos, fl, d, lens);
+        else readentry(vector, pos, fl, d, lens);
+    }
+}
+
+//COMPACT HEADER
+//count, then every node in preorder with children sorted by name as varint(depth << 1 | isfile), the name
+//front coded against the last name seen at that depth (varint shared, varint rest, rest) and a file's entry
+//with varints. no limits on counts or name lengths, and it reads back in one pass with a stack of dirs
+void writecheader(charvec& to, Dir* root) {
+    std::vector<std::pair<Dir*, int64>> stack;
+    std::vector<const std::string*> last;
+    charvec nodes;
+    int64 count = 0;
+    auto pushkids = [&](Dir* d, int64 depth) {
+        std::vector<Dir*> kids = d->children;
+        std::sort(kids.begin(), kids.end(), [](Dir* a, Dir* b) { return a->name() < b->name(); });
+        for (size_t i = kids.size(); i-- > 0;) stack.push_back({ kids[i], depth });
+    };
+    pushkids(root, 0);
+    while (stack.size()) {
+        Dir* x = stack.back().first;
+        int64 depth = stack.back().second;
+        stack.pop_back();
+        const std::string& name = x->name();
+        if ((int64)last.size() <= depth) last.resize(depth + 1);
+        size_t shared = 0;
+        if (last[depth])
+            for (size_t n = MIN(name.size(), last[depth]->size()); shared < n && name[shared] == (*last[depth])[shared]; shared++);
+        last[depth] = &name;
+        writevarint(nodes, (depth << 1) | !x->isdir);
+        writevarint(nodes, shared);
+        writevarint(nodes, name.size() - shared);
+        nodes.insert(nodes.end(), name.begin() + shared, name.end());
+        if (x->isdir) pushkids(x, depth + 1);
+        else writeentry(nodes, x, 0, true);
+        count++;
+    }
+    writevarint(to, count);
+    to.insert(to.end(), nodes.begin(), nodes.end());
+}
+void readcheader(ByteView vector, int64& pos, Dir* root) {
+    std::vector<Dir*> dirs = { root };
+    std::vector<std::string> last;
+    for (uint64_t i = 0, count = readvarint(vector, pos); i < count && pos < vector.size; i++) {
+        uint64_t head = readvarint(vector, pos);
+        size_t depth = MIN(head >> 1, dirs.size() - 1);
+        if (last.size() <= depth) last.resize(depth + 1);
+        std::string& name = last[depth];
+        name.resize(MIN(readvarint(vector, pos), name.size()));
+        charvec rest = readvec(vector, readvarint(vector, pos), pos);
+        name.append(rest.begin(), rest.end());
+        Dir* d = root->tree->add(dirs[depth], name, !(head & 1));
+        dirs.resize(depth + 1);
+        if (d->isdir) dirs.push_back(d);
+        else readentry(vector, pos, 0, d, true);
+    }
+}
+
+//PATH INDEX
+//after a trailing header: for every file in path order pathlen(2 or varint) path and its entry, then a table of
+//count(8) and where each of those starts(8 each), found through the 8 bytes before the header's offset.
+//the table is fixed width so one file or a glob's worth of them can be found by binary search
+//the i-th path, pos is left on its entry. table is where the table is in the patch, base what its offsets are from
+inline std::string indexpath(ByteView vector, int64 base, int64 table, int64 i, int64& pos, byte fl) {
+    int64 slot = table + 8 + i * 8;
+    pos = base + readintvec(vector, 8, slot);
+    charvec p = readvec(vector, readnum(vector, fl ? 2 : 0, pos), pos);
+    return std::string(p.begin(), p.end());
+}
+
+//* and ? don't go past a '/', ** does
+inline bool globmatch(const char* p, const char* s) {
+    for (; *p; p++, s++) {
+        if (*p == '*') {
+            bool deep = p[1] == '*';
+            p += deep ? 2 : 1;
+            for (;; s++) {
+                if (globmatch(p, s)) return true;
+                if (!*s || (!deep && *s == '/')) return false;
             }
         }
+        if (!*s || (*p == '?' ? *s == '/' : *p != *s)) return false;
     }
-    //return std::unique_ptr<Dir>(parent);
+    return !*s;
 }
\ No newline at end of file